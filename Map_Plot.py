@@ -8,8 +8,8 @@ in_file = sys.argv[1]
 # nom del fitxer de sortida: el mateix que l'entrada, canviant extensio per html
 mapfile = in_file.split('.')[-2] + ".html"
 
-# convertim les dades del fitxer en un array de numpy
-xy_array = np.genfromtxt(in_file, delimiter="|", skip_header=3)
+# convertim les dades del fitxer en un array de numpy; les linies de capcalera comencen per #
+xy_array = np.genfromtxt(in_file, delimiter="|", comments="#")
 xy = xy_array.tolist()
 
 # Obtenim les coordenades de les llistes
@@ -1,8 +1,18 @@
+#define _GNU_SOURCE // CPU affinity in numaplace.h
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "geokernels.h"
+#include "crp.h"
+#include "numaplace.h"
+#include "binmap.h"
 
 #define R 6371
 
@@ -12,209 +22,2837 @@
 
 typedef struct
 {
-    unsigned long id; // Node identification
-    char *name;
-    double lat, lon;      // Node position
-    unsigned short nsucc; // Number of node successors; i. e. length of successors
-    unsigned long *successors;
-    int g;
-    double h;
     double f;
-    int index;
-    int parent_index;
-} node;
+    unsigned long index;
+} heapitem;
+
+typedef struct
+{
+    heapitem *items;
+    unsigned long size, capacity;
+} heap;
+
+// Dijkstra state that is reused between searches: only the nodes a search
+// touched are reset before the next one.
+typedef struct
+{
+    double *dist;
+    long *parent;           // Predecessor on the best path found, -1 for the origin
+    unsigned char *closed;  // Nodes already expanded by aStar
+    double *succ_h;         // Heuristic of the successors of the expanded node
+    unsigned long *touched; // Nodes with a finite dist, in the order they were reached
+    unsigned long ntouched;
+    heap queue;
+} search;
+
+typedef struct
+{
+    unsigned long *items;
+    unsigned long size, capacity;
+} nodelist;
+
+// Shared state of a parallel delta-stepping run. Node v with tentative
+// distance d lives in bucket floor(d / delta) of the thread that set d. The
+// buckets are processed in order; in every phase the threads gather their
+// entries of the current bucket into frontier and split it evenly.
+typedef struct
+{
+    graph *map;
+    double *dist; // Updated with compare-and-swap by all the threads
+    double *done; // Distance each node had when its edges were last relaxed, claimed with compare-and-swap
+    double delta;
+    int nthreads;
+    pthread_barrier_t barrier;
+    unsigned long *frontier, nfrontier, frontiercap;
+    unsigned long *offset;  // Where each thread copies its part of the frontier
+    unsigned long *nextmin; // Lowest non empty bucket of each thread
+} deltastep;
+
+typedef struct
+{
+    deltastep *shared;
+    graph *map; // The replica on the NUMA node of the thread, or shared->map
+    int id, node; // node is where the thread is pinned, -1 for nowhere
+    nodelist *buckets;
+    unsigned long nbuckets;
+    nodelist settled; // Nodes taken from the current bucket, for the heavy edges
+} deltathread;
+
+// One A* query of the interleaved batch engine, advanced one stage at a time.
+// Every stage prefetches what the next one reads, and the engine runs the
+// stages of the other queries in between, so the cache misses overlap.
+enum
+{
+    QM_START, // Take the next query
+    QM_POP,   // Pop the next node, prefetch its edges and weights
+    QM_SUCC,  // Read the edges, prefetch the successors' coordinates and costs
+    QM_RELAX, // Relax the edges, prefetch what the next pop reads
+    QM_DONE
+};
+
+typedef struct
+{
+    int state;
+    long query; // Index in the batch
+    unsigned long v, target;
+    double tx, ty, tz;
+    search s;
+    unsigned long expanded;
+} querymachine;
+
+typedef struct
+{
+    graph *map;
+    unsigned long *pairs; // origin, target, origin, target ...
+    double *cost;         // Result of every query
+    int nqueries, first, step;
+    int width; // Queries interleaved, 1 for plain A* one after the other
+    unsigned long expanded;
+} batchjob;
+
+#define CACHE_TREE ((unsigned long)-1) // Target of the entries that hold a one-to-all tree
+#define CACHE_TREE_SHARE 4                // A tree may take at most 1/4 of the cache
+
+// A cached route, or the whole shortest path tree of an origin. Every entry is
+// in one hash chain and in the LRU list, which goes from newest to oldest.
+typedef struct cacheentry
+{
+    unsigned long origin, target;
+    int profile;
+    unsigned long version; // Graph version the entry was computed on
+    double cost;
+    unsigned long *path; // Routes: node indices from origin to target
+    unsigned long npath;
+    double *dist; // Trees: distance and predecessor of every node
+    long *parent;
+    unsigned long bytes; // Memory charged to the cache for this entry
+    struct cacheentry *next, *newer, *older;
+} cacheentry;
 
 typedef struct
 {
-    node *nodes;
-    unsigned short size;
-} queue;
+    cacheentry **buckets;
+    unsigned long nbuckets, nentries;
+    cacheentry *newest, *oldest;
+    unsigned long bytes, capacity; // Memory used and allowed, in bytes
+    unsigned long version;         // Version of the graph currently loaded
+    unsigned char *origincount;    // Queries seen from every origin and profile, to spot the hot ones
+    int hot;                       // Queries from an origin before its tree is cached, 0 for never
+    unsigned long hits, treehits, misses, evictions, invalidations;
+} routecache;
 
 unsigned long searchNode(unsigned long id, node *nodes, unsigned long nnodes);
-queue dequeue(queue original_queue);
-queue enqueue(queue original_queue, node *nodes, unsigned long index);
+unsigned long findNode(graph *map, const char *arg, int verbose);
+int splitQuery(char *line, char **fields, int max);
+int findNames(graph *map, const char *name, unsigned long *lo, unsigned long *hi);
+void heapPush(heap *h, double f, unsigned long index);
+heapitem heapPop(heap *h);
+void searchInit(search *s, graph *map);
+void searchReset(search *s);
+void searchFree(search *s);
+double aStar(graph *map, search *s, unsigned long origin, unsigned long target, unsigned long *expanded);
+double weightedAStar(graph *map, search *s, unsigned long origin, unsigned long target, double w, unsigned long *expanded);
+double araStar(graph *map, search *s, unsigned long origin, unsigned long target, double w, double step, double budget, double *bound, unsigned long *expanded);
+void walkPath(long *parent, unsigned long target, nodelist *path);
+unsigned long graphVersion(graph *map);
+void cacheInit(routecache *c, unsigned long capacity, int hot, graph *map);
+cacheentry *cacheFind(routecache *c, unsigned long origin, unsigned long target, int profile);
+void cacheInsert(routecache *c, cacheentry *e);
+void cacheRemove(routecache *c, cacheentry *e);
+double cacheRoute(routecache *c, graph *map, search *s, unsigned long origin, unsigned long target, int profile, nodelist *path, const char **source);
+int queriesMode(graph *map, int argc, char *argv[]);
+void transposeGraph(graph *map, unsigned long **rfirst, unsigned long **radj, double **rweight);
+int alternativesMode(graph *map, int argc, char *argv[]);
+void viaPath(search *fw, search *bw, unsigned long v, nodelist *path, double *cost);
+int compareHeapItems(const void *a, const void *b);
+unsigned long boundedDijkstra(graph *map, search *s, unsigned long origin, double bound);
+int isochroneMode(graph *map, int argc, char *argv[]);
+int readOrigins(graph *map, int argc, char *argv[], unsigned long **origins);
+int convexHull(graph *map, unsigned long *points, unsigned long npoints, unsigned long *hull);
+int ssspMode(graph *map, int argc, char *argv[]);
+void deltaStepping(graph *map, unsigned long origin, double delta, int nthreads, double *dist, long *parent, graph *replicas, int nreplicas);
+int replicateGraph(graph *map, graph *replica, int huge, int node);
+void freeReplica(graph *replica, int node);
+void benchMem(graph *map, int nqueries, int nthreads);
+int batchMode(graph *map, int argc, char *argv[]);
+void *batchWorker(void *arg);
+void machineStep(graph *map, querymachine *m, batchjob *job, int *next);
+double runBatch(graph *map, unsigned long *pairs, double *cost, int nqueries, int nthreads, int width, unsigned long *expanded);
+void *benchMemWorker(void *arg);
+void *deltaWorker(void *arg);
+double wallClock(void);
+int crpMode(const char *binmapname, const char *profilename, int argc, char *argv[]);
+void crpUnpack(crpgraph *g, int level, unsigned long a, unsigned long b, nodelist *path);
+void benchGeo(graph *map, int repeats);
 double haversine(double lat1, double lon1, double lat2, double lon2);
 double toRadians(double degree);
 
 int main(int argc, char *argv[])
 {
     clock_t start_time;
-    unsigned long nnodes;
+    graph map;
 
-    start_time = clock();
+    if (argc < 3)
+    {
+        printf("Usage: %s map.bin [--profile name] origin target\n", argv[0]);
+        printf("       %s map.bin --iso bound[s] [--speed kmh] [--hull] origin|@file ...\n", argv[0]);
+        printf("       %s map.bin --sssp origin [--delta m] [--threads n] [--verify] [--scale maxthreads] [--numa]\n", argv[0]);
+        printf("       %s map.bin --crp origin target\n", argv[0]);
+        printf("       %s map.bin --queries file [--cache MB] [--hot n]\n", argv[0]);
+        printf("       %s map.bin --alt origin target [--count n] [--stretch e] [--sharing g] [--local a]\n", argv[0]);
+        printf("       %s map.bin --bench-geo [repeats]\n", argv[0]);
+        printf("       %s map.bin --bench-mem [queries] [threads]\n", argv[0]);
+        printf("       %s map.bin --batch queries|@file [--width k] [--threads n]\n", argv[0]);
+        printf("--profile name (dist, car, bike, foot) and --hugepages thp|explicit can precede any mode\n");
+        return 1;
+    }
 
-    char binmapname[80];
-    strcpy(binmapname, argv[1]);
+    // Options that go before the mode. They are dropped from argv so the modes
+    // below see the usual arguments.
+    const char *profilename = NULL;
+    map.huge = PLACE_MALLOC;
+    while (argc > 4 && (strcmp(argv[2], "--profile") == 0 || strcmp(argv[2], "--hugepages") == 0))
+    {
+        if (strcmp(argv[2], "--profile") == 0)
+            profilename = argv[3];
+        else if (strcmp(argv[3], "thp") == 0)
+            map.huge = placeInit(PLACE_THP);
+        else if (strcmp(argv[3], "explicit") == 0)
+            map.huge = placeInit(PLACE_HUGETLB);
+        else if (strcmp(argv[3], "off") != 0)
+        {
+            printf("Unknown page size %s\n", argv[3]);
+            return 1;
+        }
+        argv[3] = argv[1];
+        argv += 2;
+        argc -= 2;
+    }
+    if (strcmp(argv[2], "--crp") == 0)
+        return crpMode(argv[1], profilename, argc - 3, argv + 3); // Reads only the cells it needs, not the .bin
 
-    FILE *binmapfile;
+    const char *kernel = geo_init();
     start_time = clock();
+    if (loadGraph(argv[1], &map) != 0)
+        return 2;
 
-    binmapfile = fopen(binmapname, "rb");
-    fread(&nnodes, sizeof(unsigned long), 1, binmapfile);
+    node *nodes = map.nodes;
+    unsigned long nnodes = map.nnodes;
 
-    node *nodes;
+    printf("Total number of nodes is %ld\n", nnodes);
+    printf("Elapsed time: %f seconds\n", (float)(clock() - start_time) / CLOCKS_PER_SEC);
+
+    if (profilename != NULL)
+    {
+        int p = findProfile(&map, profilename);
+        if (p < 0)
+        {
+            printf("Profile %s not found in the map\n", profilename);
+            return 1;
+        }
+        useProfile(&map, p);
+    }
+    printf("Profile %s (%ld edges, weights in %s)\n", map.profiles[map.current].header.name, map.nedges, map.profiles[map.current].header.unit);
 
-    nodes = (node *)malloc(nnodes * sizeof(node));
+    if (strcmp(argv[2], "--bench-mem") == 0)
+    {
+        benchMem(&map, argc > 3 ? atoi(argv[3]) : 200, argc > 4 ? atoi(argv[4]) : sysconf(_SC_NPROCESSORS_ONLN));
+        return 0;
+    }
+    if (strcmp(argv[2], "--batch") == 0)
+        return batchMode(&map, argc - 3, argv + 3);
+    if (strcmp(argv[2], "--bench-geo") == 0)
+    {
+        benchGeo(&map, argc > 3 ? atoi(argv[3]) : 10);
+        return 0;
+    }
+    if (strcmp(argv[2], "--iso") == 0)
+        return isochroneMode(&map, argc - 3, argv + 3);
+    if (strcmp(argv[2], "--sssp") == 0)
+        return ssspMode(&map, argc - 3, argv + 3);
+    if (strcmp(argv[2], "--queries") == 0)
+        return queriesMode(&map, argc - 3, argv + 3);
+    if (strcmp(argv[2], "--alt") == 0)
+        return alternativesMode(&map, argc - 3, argv + 3);
 
-    if (nodes == NULL)
+    // Bounded suboptimal searches: weighted A*, or ARA* within a time budget
+    double weight = 0, budget = -1, step = 0.5; // weight 0: no --weight given
+    while (argc > 5 && (strcmp(argv[2], "--weight") == 0 || strcmp(argv[2], "--anytime") == 0 || strcmp(argv[2], "--step") == 0))
     {
-        printf("Error when allocating the memory for the nodes\n");
-        return 2;
+        if (strcmp(argv[2], "--weight") == 0)
+            weight = atof(argv[3]);
+        else if (strcmp(argv[2], "--anytime") == 0)
+            budget = atof(argv[3]) / 1000;
+        else
+            step = atof(argv[3]);
+        argv += 2;
+        argc -= 2;
+    }
+    if (weight == 0 && budget >= 0)
+        weight = 3; // The first path of ARA*
+    if (weight < 1)
+        weight = 1;
+    if (step <= 0)
+        step = 0.5;
+    if (argc < 4)
+    {
+        printf("Missing the target node\n");
+        return 1;
     }
-    fread(nodes, sizeof(node), nnodes, binmapfile);
 
-    for (int i = 0; i < nnodes; ++i)
+    unsigned long origin_index, target_index;
+
+    // We take the origin and target nodes for the A* algorithm, by id or by name
+    origin_index = findNode(&map, argv[2], 1);
+    target_index = findNode(&map, argv[3], 1);
+    if (origin_index == nnodes + 1 || target_index == nnodes + 1)
     {
-        nodes[i].successors = (unsigned long *)malloc(sizeof(unsigned long) * nodes[i].nsucc);
-        fread(nodes[i].successors, sizeof(unsigned long), nodes[i].nsucc, binmapfile);
+        printf("Origin or target node not found in the map\n");
+        return 1;
     }
 
-    fclose(binmapfile);
+    start_time = clock();
 
-    printf("Total number of nodes is %ld\n", nnodes);
+    search s;
+    unsigned long expanded;
+    double bound = weight;
+    searchInit(&s, &map);
+    if (budget >= 0)
+        araStar(&map, &s, origin_index, target_index, weight, step, budget, &bound, &expanded);
+    else
+        weightedAStar(&map, &s, origin_index, target_index, weight, &expanded);
+    printf("Expanded %lu nodes (%s kernel)\n", expanded, kernel);
+    if (bound > 1)
+        printf("Suboptimality bound: %lf\n", bound);
     printf("Elapsed time: %f seconds\n", (float)(clock() - start_time) / CLOCKS_PER_SEC);
 
-    node origin_node, target_node;
-    int origin_index, target_index;
-    char *ptr;
+    if (s.dist[target_index] == INFINITY)
+    {
+        printf("There is no path from %lu to %lu\n", nodes[origin_index].id, nodes[target_index].id);
+        return 3;
+    }
+
+    nodelist path = {NULL, 0, 0};
+    walkPath(s.parent, target_index, &path);
+    int depth = path.size - 1;
+    unsigned long *finalpath = path.items;
+
+    printf("Path was started from: %lu and depth %d\n", nodes[origin_index].id, 0);
+    printf("Path arrived at: %lu and depth %d\n", nodes[target_index].id, depth);
+
+    double *segment = (double *)malloc((depth + 1) * sizeof(double));
+
+    // Length of every segment of the path in one batch
+    geo_distance(map.x, map.y, map.z, finalpath, finalpath + 1, depth, segment);
+
+    double total_distance = 0;
+    for (int i = 0; i < depth; i++)
+    {
+        total_distance += segment[i];
+    }
+
+    FILE *pathtxt;
+
+    pathtxt = fopen("finalpath.txt", "w");
+
+    if (map.current != 0)
+        fprintf(pathtxt, "# Distance from %lu to %lu: %lf meters, cost %lf %s with the %s profile.\n", nodes[origin_index].id, nodes[target_index].id,
+                total_distance, s.dist[target_index], map.profiles[map.current].header.unit, map.profiles[map.current].header.name);
+    else
+        fprintf(pathtxt, "# Distance from %lu to %lu: %lf meters.\n", nodes[origin_index].id, nodes[target_index].id, total_distance);
+    if (bound > 1)
+        fprintf(pathtxt, "# Path at most %lf times longer than the optimal one:\n", bound);
+    else
+        fprintf(pathtxt, "# Optimal path:\n");
+
+    double cumulative_distance = 0;
+    for (int i = 0; i <= depth; i++)
+    {
+        if (i != 0)
+        {
+            cumulative_distance += segment[i - 1];
+        }
+        fprintf(pathtxt, "Id = %lu | %lf | %lf | Dist = %lf\n", nodes[finalpath[i]].id, nodes[finalpath[i]].lat, nodes[finalpath[i]].lon, cumulative_distance);
+    }
+
+    fclose(pathtxt);
+
+    return 0;
+}
+
+void heapPush(heap *h, double f, unsigned long index)
+{
+    if (h->size == h->capacity)
+    {
+        h->capacity = h->capacity ? 2 * h->capacity : 1024;
+        h->items = realloc(h->items, h->capacity * sizeof(heapitem));
+        if (h->items == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    // Sift up from the new leaf
+    unsigned long i = h->size++;
+    while (i > 0 && h->items[(i - 1) / 2].f > f)
+    {
+        h->items[i] = h->items[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    h->items[i].f = f;
+    h->items[i].index = index;
+}
+
+heapitem heapPop(heap *h)
+{
+    heapitem top = h->items[0], last = h->items[--h->size];
+    // Sift the last item down from the root
+    unsigned long i = 0, child;
+    while ((child = 2 * i + 1) < h->size)
+    {
+        if (child + 1 < h->size && h->items[child + 1].f < h->items[child].f)
+            child++;
+        if (h->items[child].f >= last.f)
+            break;
+        h->items[i] = h->items[child];
+        i = child;
+    }
+    h->items[i] = last;
+    return top;
+}
 
-    // We take the origin and target nodes for the A* algorithm
-    origin_index = searchNode(strtoul(argv[2], &ptr, 10), nodes, nnodes);
-    origin_node = nodes[origin_index];
+void searchInit(search *s, graph *map)
+{
+    unsigned long nnodes = map->nnodes;
+    s->dist = (double *)malloc(nnodes * sizeof(double));
+    s->parent = (long *)malloc(nnodes * sizeof(long));
+    s->closed = (unsigned char *)calloc(nnodes, sizeof(unsigned char));
+    s->succ_h = (double *)malloc((map->maxsucc + 1) * sizeof(double));
+    s->touched = (unsigned long *)malloc(nnodes * sizeof(unsigned long));
+    if (s->dist == NULL || s->parent == NULL || s->closed == NULL || s->succ_h == NULL || s->touched == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned long i = 0; i < nnodes; i++)
+        s->dist[i] = INFINITY;
+    s->ntouched = 0;
+    s->queue.items = NULL;
+    s->queue.size = s->queue.capacity = 0;
+}
 
-    target_index = searchNode(strtoul(argv[3], &ptr, 10), nodes, nnodes);
-    target_node = nodes[target_index];
+void searchFree(search *s)
+{
+    free(s->dist);
+    free(s->parent);
+    free(s->closed);
+    free(s->succ_h);
+    free(s->touched);
+    free(s->queue.items);
+}
 
-    // We create the queue
-    queue priorityqueue;
-    priorityqueue.size = 1;
-    priorityqueue.nodes = (node *)malloc(sizeof(node));
-    priorityqueue.nodes[0] = origin_node;
+void searchReset(search *s)
+{
+    for (unsigned long i = 0; i < s->ntouched; i++)
+    {
+        s->dist[s->touched[i]] = INFINITY;
+        s->closed[s->touched[i]] = 0;
+    }
+    s->ntouched = 0;
+    s->queue.size = 0;
+}
 
-    // A* algorithm begins
-    node current_node;
-    unsigned long succ_index;
+// Dijkstra from origin that never goes past bound. Afterwards s->touched holds
+// every node within bound of the origin and s->dist their distance.
+unsigned long boundedDijkstra(graph *map, search *s, unsigned long origin, double bound)
+{
+    searchReset(s);
+    s->dist[origin] = 0;
+    s->parent[origin] = -1;
+    s->touched[s->ntouched++] = origin;
+    heapPush(&s->queue, 0, origin);
 
-    while (priorityqueue.size != 0)
+    while (s->queue.size != 0)
     {
-        current_node = priorityqueue.nodes[0];
-        priorityqueue = dequeue(priorityqueue); // The first element of the queue is taken out
+        heapitem current = heapPop(&s->queue);
+        if (current.f > s->dist[current.index])
+            continue; // Stale entry
 
-        if (current_node.id == target_node.id)
+        for (unsigned long e = map->first[current.index]; e < map->first[current.index + 1]; e++)
         {
-            break; // We finish if this node is the target one
+            unsigned long succ_index = map->adj[e];
+            double succ_dist = current.f + map->weight[e];
+            if (succ_dist > bound || succ_dist >= s->dist[succ_index])
+                continue;
+            if (s->dist[succ_index] == INFINITY)
+                s->touched[s->ntouched++] = succ_index;
+            s->dist[succ_index] = succ_dist;
+            s->parent[succ_index] = current.index;
+            heapPush(&s->queue, succ_dist, succ_index);
         }
+    }
+    return s->ntouched;
+}
+
+// Plain A* on the weights of the current profile, i. e. weightedAStar with
+// w = 1. Returns the cost of the path, INFINITY if there is none; the path
+// itself is left in s->parent.
+double aStar(graph *map, search *s, unsigned long origin, unsigned long target, unsigned long *expanded)
+{
+    return weightedAStar(map, s, origin, target, 1, expanded);
+}
+
+// A* with f = g + w * h. With a consistent h and no node expanded twice, the
+// path found costs at most w times the optimal one.
+double weightedAStar(graph *map, search *s, unsigned long origin, unsigned long target, double w, unsigned long *expanded)
+{
+    double tx = map->x[target], ty = map->y[target], tz = map->z[target];
+    double h, hw = w * map->hscale;
+
+    searchReset(s);
+    *expanded = 0;
+    s->dist[origin] = 0;
+    s->parent[origin] = -1;
+    s->touched[s->ntouched++] = origin;
+    geo_heuristic(map->x, map->y, map->z, &origin, 1, tx, ty, tz, &h);
+    heapPush(&s->queue, hw * h, origin);
+
+    while (s->queue.size != 0)
+    {
+        heapitem current = heapPop(&s->queue);
+        if (s->closed[current.index])
+            continue; // Stale entry, the node was pushed again with a better cost
+        if (current.index == target)
+            break; // We finish if this node is the target one
+
+        s->closed[current.index] = 1;
+        (*expanded)++;
+        unsigned long *succ = map->adj + map->first[current.index];
+        unsigned long nsucc = map->first[current.index + 1] - map->first[current.index];
+        double *succ_w = map->weight + map->first[current.index];
+
+        // Heuristic values of all the successors at once
+        geo_heuristic(map->x, map->y, map->z, succ, nsucc, tx, ty, tz, s->succ_h);
 
-        if (current_node.nsucc == 0)
+        for (unsigned long i = 0; i < nsucc; i++)
         {
-            continue; // We skip if it does not have any successors
+            unsigned long succ_index = succ[i];
+            if (s->closed[succ_index])
+                continue; // Not reopened, so its cost stays the one of its parent path
+            double succ_cost = s->dist[current.index] + succ_w[i];
+            if (succ_cost < s->dist[succ_index]) // If we found a shorter way to it we add it to the priority queue
+            {
+                if (s->dist[succ_index] == INFINITY)
+                    s->touched[s->ntouched++] = succ_index;
+                s->dist[succ_index] = succ_cost;
+                s->parent[succ_index] = current.index;
+                heapPush(&s->queue, succ_cost + hw * s->succ_h[i], succ_index);
+            }
         }
+    }
+    return s->dist[target];
+}
+
+// Reachable nodes from one or many origins within a distance (meters) or a
+// travel time (seconds at a constant speed). Writes isochrone.txt.
+int isochroneMode(graph *map, int argc, char *argv[])
+{
+    double bound, speed = 50;
+    int hull = 0, seconds = 0, first = 1;
+    char *ptr;
+
+    if (argc < 2)
+    {
+        printf("Usage: --iso bound[s] [--speed kmh] [--hull] origin|@file ...\n");
+        return 1;
+    }
+    bound = strtod(argv[0], &ptr);
+    if (*ptr == 's')
+        seconds = 1;
+    else if (*ptr != '\0' && *ptr != 'm')
+    {
+        printf("Wrong bound %s\n", argv[0]);
+        return 1;
+    }
+    while (first < argc && strncmp(argv[first], "--", 2) == 0)
+    {
+        if (strcmp(argv[first], "--hull") == 0)
+            hull = 1;
+        else if (strcmp(argv[first], "--speed") == 0 && first + 1 < argc)
+            speed = atof(argv[++first]);
         else
         {
-            for (int i = 0; i < current_node.nsucc; i++) // For every successor
+            printf("Unknown option %s\n", argv[first]);
+            return 1;
+        }
+        first++;
+    }
+    double limit = seconds ? bound * speed / 3.6 : bound;
+    if (strcmp(map->profiles[map->current].header.unit, "s") == 0)
+    {
+        // The profile already weighs travel time
+        if (!seconds)
+        {
+            printf("The %s profile measures time, give the bound in seconds\n", map->profiles[map->current].header.name);
+            return 1;
+        }
+        limit = bound;
+    }
+
+    unsigned long *origins;
+    int norigins = readOrigins(map, argc - first, argv + first, &origins);
+    if (norigins <= 0)
+    {
+        printf("No origin nodes given\n");
+        return 1;
+    }
+
+    search s;
+    searchInit(&s, map);
+    unsigned long *boundary = (unsigned long *)malloc((map->nnodes + 1) * sizeof(unsigned long));
+    FILE *isotxt = fopen("isochrone.txt", "w");
+    if (boundary == NULL || isotxt == NULL)
+    {
+        printf("Error when preparing the isochrone output\n");
+        return 2;
+    }
+
+    clock_t start_time = clock(), search_time = 0;
+    unsigned long total = 0;
+    for (int o = 0; o < norigins; o++)
+    {
+        clock_t t = clock();
+        unsigned long nreached = boundedDijkstra(map, &s, origins[o], limit);
+        search_time += clock() - t;
+        total += nreached;
+
+        fprintf(isotxt, "# Isochrone of %lu: %lu nodes within %lf %s.\n", map->nodes[origins[o]].id, nreached, limit, map->profiles[map->current].header.unit);
+        for (unsigned long i = 0; i < nreached; i++)
+        {
+            node *n = &map->nodes[s.touched[i]];
+            fprintf(isotxt, "Id = %lu | %lf | %lf | Dist = %lf\n", n->id, n->lat, n->lon, s.dist[s.touched[i]]);
+        }
+        if (hull)
+        {
+            int nboundary = convexHull(map, s.touched, nreached, boundary);
+            fprintf(isotxt, "# Boundary of %lu: %d vertices.\n", map->nodes[origins[o]].id, nboundary);
+            for (int i = 0; i < nboundary; i++)
+                fprintf(isotxt, "Boundary = %lu | %lf | %lf\n", map->nodes[boundary[i]].id, map->nodes[boundary[i]].lat, map->nodes[boundary[i]].lon);
+        }
+    }
+    fclose(isotxt);
+
+    printf("Computed %d isochrones of %lf %s, %lu reachable nodes in total\n", norigins, limit, map->profiles[map->current].header.unit, total);
+    printf("Search time: %f seconds (%f ms per origin)\n", (float)search_time / CLOCKS_PER_SEC, 1000.0 * search_time / CLOCKS_PER_SEC / norigins);
+    printf("Elapsed time: %f seconds\n", (float)(clock() - start_time) / CLOCKS_PER_SEC);
+    return 0;
+}
+
+// Node indices of the origin ids given on the command line. An argument of the
+// form @file reads one id per line from that file.
+int readOrigins(graph *map, int argc, char *argv[], unsigned long **origins)
+{
+    int n = 0, capacity = 64;
+    *origins = (unsigned long *)malloc(capacity * sizeof(unsigned long));
+
+    for (int a = 0; a < argc; a++)
+    {
+        FILE *idfile = NULL;
+        char *line = NULL, *id = argv[a];
+        size_t len;
+        if (argv[a][0] == '@')
+        {
+            idfile = fopen(argv[a] + 1, "r");
+            if (idfile == NULL)
+            {
+                printf("Error when opening the file %s\n", argv[a] + 1);
+                continue;
+            }
+        }
+        while (idfile == NULL || getline(&line, &len, idfile) != -1)
+        {
+            if (idfile != NULL)
+                id = line;
+            id[strcspn(id, "\r\n")] = '\0';
+            if (*id != '#' && *id != '\0')
             {
-                succ_index = current_node.successors[i];
-                if (nodes[succ_index].g == -1) // If it has not been visited we add it to the priority queue
+                unsigned long index = findNode(map, id, idfile == NULL);
+                if (index == map->nnodes + 1)
+                    printf("Node %s not found in the map\n", id);
+                else
                 {
-                    nodes[succ_index].g = current_node.g + 1;
-                    nodes[succ_index].h = sqrt((nodes[succ_index].lat - target_node.lat) * (nodes[succ_index].lat - target_node.lat) + (nodes[succ_index].lon - target_node.lon) * (nodes[succ_index].lon - target_node.lon));
-                    nodes[succ_index].f = nodes[succ_index].g + nodes[succ_index].h;
-                    nodes[succ_index].parent_index = current_node.index;
-                    priorityqueue = enqueue(priorityqueue, nodes, succ_index);
+                    if (n == capacity)
+                    {
+                        capacity *= 2;
+                        *origins = realloc(*origins, capacity * sizeof(unsigned long));
+                    }
+                    (*origins)[n++] = index;
                 }
             }
+            if (idfile == NULL)
+                break;
+        }
+        if (idfile != NULL)
+        {
+            free(line);
+            fclose(idfile);
         }
     }
-    printf("Path was started from: %lu and depth %d\n", nodes[origin_index].id, nodes[origin_index].g);
-    printf("Path arrived at: %lu and depth %d\n", nodes[target_index].id, nodes[target_index].g);
+    return n;
+}
+
+// One-to-all shortest paths with the parallel delta-stepping engine. Writes
+// sssp.txt, or with --scale times 1, 2, 4 ... maxthreads threads.
+int ssspMode(graph *map, int argc, char *argv[])
+{
+    double delta = 0;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN), verify = 0, scale = 0, numa = 0;
 
-    node *finalpath;
-    finalpath = (node *)malloc((nodes[target_index].g + 1) * sizeof(node));
-    finalpath[nodes[target_index].g] = nodes[target_index];
-    for (int i = nodes[target_index].g - 1; i >= 0; i--)
+    if (argc < 1)
     {
-        finalpath[i] = nodes[finalpath[i + 1].parent_index];
+        printf("Usage: --sssp origin [--delta m] [--threads n] [--verify] [--scale maxthreads] [--numa]\n");
+        return 1;
     }
-
-    double total_distance = 0;
-    for (int i = 0; i <= nodes[target_index].g; i++)
+    unsigned long origin = findNode(map, argv[0], 1);
+    if (origin == map->nnodes + 1)
     {
-        if (i != 0)
+        printf("Origin node not found in the map\n");
+        return 1;
+    }
+    for (int a = 1; a < argc; a++)
+    {
+        if (strcmp(argv[a], "--delta") == 0 && a + 1 < argc)
+            delta = atof(argv[++a]);
+        else if (strcmp(argv[a], "--threads") == 0 && a + 1 < argc)
+            nthreads = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--scale") == 0 && a + 1 < argc)
+            scale = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--verify") == 0)
+            verify = 1;
+        else if (strcmp(argv[a], "--numa") == 0)
+            numa = 1;
+        else
         {
-            total_distance += haversine(finalpath[i].lat, finalpath[i].lon, finalpath[i - 1].lat, finalpath[i - 1].lon);
+            printf("Unknown option %s\n", argv[a]);
+            return 1;
         }
     }
 
-    FILE *pathtxt;
+    // One copy of the graph per NUMA node, the threads pinned next to theirs
+    graph *replicas = NULL;
+    int nreplicas = 0;
+    if (numa)
+    {
+        nreplicas = numaNodes();
+        replicas = (graph *)malloc(nreplicas * sizeof(graph));
+        for (int r = 0; r < nreplicas; r++)
+            if (replicas == NULL || replicateGraph(map, &replicas[r], map->huge, r) != 0)
+            {
+                printf("Error when allocating the memory for the replicas\n");
+                return 2;
+            }
+        printf("Replicated the graph on %d NUMA nodes\n", nreplicas);
+    }
+    if (delta <= 0)
+    {
+        // A few average edges per bucket
+        double total = 0;
+        for (unsigned long e = 0; e < map->nedges; e++)
+            total += map->weight[e];
+        delta = map->nedges ? 4 * total / map->nedges : 1;
+    }
+    if (nthreads < 1)
+        nthreads = 1;
 
-    pathtxt = fopen("finalpath.txt", "w");
+    double *dist = (double *)malloc(map->nnodes * sizeof(double));
+    long *parent = (long *)malloc(map->nnodes * sizeof(long));
+    if (dist == NULL || parent == NULL)
+    {
+        printf("Error when allocating the memory for the shortest path tree\n");
+        return 2;
+    }
 
-    fprintf(pathtxt, "# Distance from %d to %d: %lf meters.\n", atoi(argv[2]), atoi(argv[3]), total_distance);
-    fprintf(pathtxt, "# Optimal path:\n");
+    // Serial Dijkstra, the reference for --verify and --scale
+    search s;
+    double serial_time = 0;
+    if (verify || scale)
+    {
+        searchInit(&s, map);
+        double t = wallClock();
+        boundedDijkstra(map, &s, origin, INFINITY);
+        serial_time = wallClock() - t;
+        printf("Serial Dijkstra: %lu nodes reached in %f seconds\n", s.ntouched, serial_time);
+    }
 
-    double cumulative_distance = 0;
-    for (int i = 0; i <= nodes[target_index].g; i++)
+    if (scale)
     {
-        if (i != 0)
+        printf("Delta-stepping, delta = %lf %s\n", delta, map->profiles[map->current].header.unit);
+        printf("%8s %12s %12s %12s %10s\n", "threads", "seconds", "vs 1 thread", "vs Dijkstra", "identical");
+        double one_thread = 0;
+        for (int t = 1; t <= scale; t *= 2)
         {
-            cumulative_distance += haversine(finalpath[i].lat, finalpath[i].lon, finalpath[i - 1].lat, finalpath[i - 1].lon);
+            double start = wallClock();
+            deltaStepping(map, origin, delta, t, dist, parent, replicas, nreplicas);
+            double seconds = wallClock() - start;
+            if (t == 1)
+                one_thread = seconds;
+            int identical = memcmp(dist, s.dist, map->nnodes * sizeof(double)) == 0;
+            printf("%8d %12f %12.2f %12.2f %10s\n", t, seconds, one_thread / seconds, serial_time / seconds, identical ? "yes" : "NO");
         }
-        fprintf(pathtxt, "Id = %lu | %lf | %lf | Dist = %lf\n", finalpath[i].id, finalpath[i].lat, finalpath[i].lon, cumulative_distance);
+        return 0;
     }
 
-    fclose(pathtxt);
+    double start = wallClock();
+    deltaStepping(map, origin, delta, nthreads, dist, parent, replicas, nreplicas);
+    printf("Delta-stepping with %d threads and delta = %lf %s: %f seconds\n", nthreads, delta, map->profiles[map->current].header.unit, wallClock() - start);
+
+    if (verify)
+    {
+        unsigned long different = 0;
+        for (unsigned long i = 0; i < map->nnodes; i++)
+            if (memcmp(&dist[i], &s.dist[i], sizeof(double)) != 0)
+                different++;
+        printf("Distances identical to serial Dijkstra: %s (%lu different)\n", different ? "NO" : "yes", different);
+    }
+
+    FILE *sssptxt = fopen("sssp.txt", "w");
+    if (sssptxt == NULL)
+    {
+        printf("Error when opening sssp.txt\n");
+        return 1;
+    }
+    fprintf(sssptxt, "# Shortest paths from %lu\n", map->nodes[origin].id);
+    for (unsigned long i = 0; i < map->nnodes; i++)
+        if (dist[i] != INFINITY)
+            fprintf(sssptxt, "Id = %lu | %lf | %lf | Dist = %lf | Parent = %lu\n", map->nodes[i].id, map->nodes[i].lat, map->nodes[i].lon, dist[i],
+                    parent[i] >= 0 ? map->nodes[parent[i]].id : 0UL);
+    fclose(sssptxt);
+    return 0;
+}
 
+// Lowers *target to value if it is smaller. Returns 1 if this call changed it.
+static inline int atomicMinDist(double *target, double value)
+{
+    unsigned long long *bits = (unsigned long long *)target, old, new;
+    double current;
+    memcpy(&new, &value, sizeof(double));
+    old = __atomic_load_n(bits, __ATOMIC_RELAXED);
+    memcpy(&current, &old, sizeof(double));
+    while (value < current)
+    {
+        if (__atomic_compare_exchange_n(bits, &old, new, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return 1;
+        memcpy(&current, &old, sizeof(double));
+    }
+    return 0;
+}
+
+// Sets *target to value unless it already holds it. Returns 1 for the thread
+// that set it, so a node repeated in the frontier is relaxed only once.
+static inline int claimDist(double *target, double value)
+{
+    unsigned long long *bits = (unsigned long long *)target, old, new;
+    memcpy(&new, &value, sizeof(double));
+    old = __atomic_load_n(bits, __ATOMIC_RELAXED);
+    while (old != new)
+        if (__atomic_compare_exchange_n(bits, &old, new, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return 1;
     return 0;
 }
 
-queue enqueue(queue original_queue, node *nodes, unsigned long index)
+static inline double loadDist(double *target)
+{
+    unsigned long long bits = __atomic_load_n((unsigned long long *)target, __ATOMIC_RELAXED);
+    double value;
+    memcpy(&value, &bits, sizeof(double));
+    return value;
+}
+
+static inline void nodelistPush(nodelist *l, unsigned long index)
+{
+    if (l->size == l->capacity)
+    {
+        l->capacity = l->capacity ? 2 * l->capacity : 64;
+        l->items = realloc(l->items, l->capacity * sizeof(unsigned long));
+        if (l->items == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    l->items[l->size++] = index;
+}
+
+// Relaxes the light (weight <= delta) or the heavy edges of v
+static inline void relaxEdges(deltathread *self, unsigned long v, double dv, int light)
 {
-    original_queue.size++;
-    original_queue.nodes = realloc(original_queue.nodes, original_queue.size * sizeof(node));
-    if (original_queue.size != 1)
+    deltastep *shared = self->shared;
+    graph *map = self->map;
+    for (unsigned long e = map->first[v]; e < map->first[v + 1]; e++)
     {
-        for (int i = 0; i < original_queue.size; i++)
+        if ((map->weight[e] <= shared->delta) != light)
+            continue;
+        unsigned long u = map->adj[e];
+        double du = dv + map->weight[e];
+        if (atomicMinDist(&shared->dist[u], du))
         {
-            if (i == original_queue.size - 1)
+            unsigned long b = (unsigned long)(du / shared->delta);
+            if (b >= self->nbuckets)
             {
-                original_queue.nodes[i] = nodes[index];
+                unsigned long n = b + 1 > 2 * self->nbuckets ? b + 1 : 2 * self->nbuckets;
+                self->buckets = realloc(self->buckets, n * sizeof(nodelist));
+                memset(self->buckets + self->nbuckets, 0, (n - self->nbuckets) * sizeof(nodelist));
+                self->nbuckets = n;
             }
-            if (nodes[index].f < original_queue.nodes[i].f)
+            nodelistPush(&self->buckets[b], u);
+        }
+    }
+}
+
+void *deltaWorker(void *arg)
+{
+    deltathread *self = (deltathread *)arg;
+    deltastep *shared = self->shared;
+    int n = shared->nthreads;
+    unsigned long bucket = 0;
+
+    if (self->node >= 0)
+        pinThread(self->node);
+
+    while (1)
+    {
+        // Phases on the current bucket until no thread adds to it
+        while (1)
+        {
+            unsigned long mine = bucket < self->nbuckets ? self->buckets[bucket].size : 0;
+            shared->offset[self->id] = mine;
+            pthread_barrier_wait(&shared->barrier);
+            if (self->id == 0)
             {
-                for (int j = original_queue.size - 1; j > i; j--)
+                unsigned long total = 0;
+                for (int t = 0; t < n; t++)
+                {
+                    unsigned long size = shared->offset[t];
+                    shared->offset[t] = total;
+                    total += size;
+                }
+                if (total > shared->frontiercap)
                 {
-                    original_queue.nodes[j] = original_queue.nodes[j - 1];
+                    shared->frontiercap = 2 * total;
+                    shared->frontier = realloc(shared->frontier, shared->frontiercap * sizeof(unsigned long));
+                    if (shared->frontier == NULL)
+                    {
+                        fprintf(stderr, "Memory allocation failed.\n");
+                        exit(EXIT_FAILURE);
+                    }
                 }
-                original_queue.nodes[i] = nodes[index];
+                shared->nfrontier = total;
+            }
+            pthread_barrier_wait(&shared->barrier);
+            if (mine)
+            {
+                memcpy(shared->frontier + shared->offset[self->id], self->buckets[bucket].items, mine * sizeof(unsigned long));
+                self->buckets[bucket].size = 0;
+            }
+            pthread_barrier_wait(&shared->barrier);
+            unsigned long total = shared->nfrontier;
+            if (total == 0)
                 break;
+
+            for (unsigned long i = total * self->id / n; i < total * (self->id + 1) / n; i++)
+            {
+                unsigned long v = shared->frontier[i];
+                double dv = loadDist(&shared->dist[v]);
+                if ((unsigned long)(dv / shared->delta) != bucket || !claimDist(&shared->done[v], dv))
+                    continue; // Moved to another bucket, or already relaxed with this distance
+                nodelistPush(&self->settled, v);
+                relaxEdges(self, v, dv, 1);
             }
+            pthread_barrier_wait(&shared->barrier);
         }
+
+        // The bucket is final: relax the heavy edges of its nodes
+        for (unsigned long i = 0; i < self->settled.size; i++)
+        {
+            unsigned long v = self->settled.items[i];
+            relaxEdges(self, v, loadDist(&shared->dist[v]), 0);
+        }
+        self->settled.size = 0;
+
+        // Next non empty bucket of any thread
+        unsigned long next = bucket + 1;
+        while (next < self->nbuckets && self->buckets[next].size == 0)
+            next++;
+        shared->nextmin[self->id] = next < self->nbuckets ? next : (unsigned long)-1;
+        pthread_barrier_wait(&shared->barrier);
+        bucket = (unsigned long)-1;
+        for (int t = 0; t < n; t++)
+            if (shared->nextmin[t] < bucket)
+                bucket = shared->nextmin[t];
+        pthread_barrier_wait(&shared->barrier);
+        if (bucket == (unsigned long)-1)
+            break;
     }
-    else
-    {
-        original_queue.nodes[0] = nodes[index];
-    }
-    return original_queue;
+    return NULL;
 }
 
-queue dequeue(queue original_queue)
+// Parallel one-to-all shortest paths (delta-stepping). dist gets the same
+// values a serial Dijkstra computes; parent gets one shortest path tree.
+// With replicas, thread t works on replicas[t % nreplicas], pinned to the NUMA
+// node of that replica.
+void deltaStepping(graph *map, unsigned long origin, double delta, int nthreads, double *dist, long *parent, graph *replicas, int nreplicas)
 {
-    queue temp_queue;
-    temp_queue.size = original_queue.size - 1;
-    temp_queue.nodes = (node *)malloc(temp_queue.size * sizeof(node));
-    for (int i = 1; i < original_queue.size; i++)
+    deltastep shared;
+    deltathread *threads = (deltathread *)calloc(nthreads, sizeof(deltathread));
+    pthread_t *ids = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+
+    shared.map = map;
+    shared.dist = dist;
+    shared.done = (double *)malloc(map->nnodes * sizeof(double));
+    shared.delta = delta;
+    shared.nthreads = nthreads;
+    shared.frontiercap = 1024;
+    shared.frontier = (unsigned long *)malloc(shared.frontiercap * sizeof(unsigned long));
+    shared.offset = (unsigned long *)malloc(nthreads * sizeof(unsigned long));
+    shared.nextmin = (unsigned long *)malloc(nthreads * sizeof(unsigned long));
+    if (threads == NULL || ids == NULL || shared.done == NULL || shared.frontier == NULL || shared.offset == NULL || shared.nextmin == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_barrier_init(&shared.barrier, NULL, nthreads);
+
+    for (unsigned long i = 0; i < map->nnodes; i++)
     {
-        temp_queue.nodes[i - 1] = original_queue.nodes[i];
+        dist[i] = INFINITY;
+        shared.done[i] = -1;
     }
-    free(original_queue.nodes);
-    original_queue.nodes = (node *)malloc(temp_queue.size * sizeof(node));
-    for (int i = 0; i < temp_queue.size; i++)
+    dist[origin] = 0;
+    for (int t = 0; t < nthreads; t++)
     {
-        original_queue.nodes[i] = temp_queue.nodes[i];
+        threads[t].shared = &shared;
+        threads[t].id = t;
+        threads[t].map = replicas != NULL ? &replicas[t % nreplicas] : map;
+        threads[t].node = replicas != NULL ? t % nreplicas : -1;
     }
-    original_queue.size = temp_queue.size;
-    free(temp_queue.nodes);
-    return original_queue;
+    threads[0].nbuckets = 1;
+    threads[0].buckets = (nodelist *)calloc(1, sizeof(nodelist));
+    nodelistPush(&threads[0].buckets[0], origin);
+
+    for (int t = 1; t < nthreads; t++)
+        pthread_create(&ids[t], NULL, deltaWorker, &threads[t]);
+    deltaWorker(&threads[0]);
+    for (int t = 1; t < nthreads; t++)
+        pthread_join(ids[t], NULL);
+
+    // Parent of every node: a breadth-first walk from the origin over the
+    // edges on shortest paths. A node gets its parent when it is first reached,
+    // so zero weight edges cannot close a cycle.
+    nodelist order = {NULL, 0, 0};
+    for (unsigned long i = 0; i < map->nnodes; i++)
+        parent[i] = -1;
+    nodelistPush(&order, origin);
+    for (unsigned long i = 0; i < order.size; i++)
+    {
+        unsigned long u = order.items[i];
+        for (unsigned long e = map->first[u]; e < map->first[u + 1]; e++)
+        {
+            unsigned long v = map->adj[e];
+            if (parent[v] < 0 && v != origin && dist[u] + map->weight[e] == dist[v])
+            {
+                parent[v] = u;
+                nodelistPush(&order, v);
+            }
+        }
+    }
+    free(order.items);
+
+    for (int t = 0; t < nthreads; t++)
+    {
+        for (unsigned long b = 0; b < threads[t].nbuckets; b++)
+            free(threads[t].buckets[b].items);
+        free(threads[t].buckets);
+        free(threads[t].settled.items);
+    }
+    pthread_barrier_destroy(&shared.barrier);
+    free(shared.done);
+    free(shared.frontier);
+    free(shared.offset);
+    free(shared.nextmin);
+    free(threads);
+    free(ids);
+}
+
+// Point to point query on the partitioned graph written by createcrp. Only the
+// overlay (boundary vertices, cut edges and cliques) is read up front; leaf
+// cells are read when the search or the path unpacking needs them.
+int crpMode(const char *binmapname, const char *profilename, int argc, char *argv[])
+{
+    char crpname[256], metricname[264];
+    crpgraph g;
+    double start = wallClock();
+
+    if (argc < 2)
+    {
+        printf("Usage: --crp origin target\n");
+        return 1;
+    }
+    // createcrp --profile writes one partition per profile
+    if (profilename == NULL || strcmp(profilename, "dist") == 0)
+    {
+        profilename = "dist";
+        snprintf(crpname, sizeof(crpname), "%s.crp", binmapname);
+    }
+    else
+        snprintf(crpname, sizeof(crpname), "%s.%s.crp", binmapname, profilename);
+    snprintf(metricname, sizeof(metricname), "%s.metric", crpname);
+    FILE *crpfile = fopen(crpname, "rb"), *metricfile = fopen(metricname, "rb");
+    if (crpfile == NULL || metricfile == NULL || crpReadTopology(crpfile, &g) != 0 || crpReadMetric(metricfile, &g) != 0)
+    {
+        printf("Error when reading %s and %s, run createcrp --profile %s first\n", crpname, metricname, profilename);
+        return 1;
+    }
+    printf("Partitioned map: %lu nodes, %lu leaf cells, %d levels, %lu boundary vertices\n", g.nnodes, g.ncells, g.nlevels, g.noverlay);
+    printf("Elapsed time: %f seconds\n", wallClock() - start);
+
+    start = wallClock();
+    unsigned long s = crpFindId(&g, strtoul(argv[0], NULL, 10)), t = crpFindId(&g, strtoul(argv[1], NULL, 10));
+    if (s == g.nnodes + 1 || t == g.nnodes + 1)
+    {
+        printf("Origin or target node not found in the map\n");
+        return 1;
+    }
+    unsigned long leafs = crpLeaf(&g, s), leaft = crpLeaf(&g, t);
+
+    // Pages of these arrays are only touched for the nodes the search reaches
+    double *dist = (double *)malloc(g.nnodes * sizeof(double));
+    long *parent = (long *)malloc(g.nnodes * sizeof(long));
+    signed char *parentlevel = (signed char *)malloc(g.nnodes);
+    unsigned char *seen = (unsigned char *)calloc(g.nnodes, 1);
+    if (dist == NULL || parent == NULL || parentlevel == NULL || seen == NULL)
+    {
+        printf("Error when allocating the memory for the search\n");
+        return 2;
+    }
+
+    heap queue = {NULL, 0, 0};
+    unsigned long scanned = 0;
+    dist[s] = 0;
+    parent[s] = -1;
+    seen[s] = 1;
+    heapPush(&queue, 0, s);
+    while (queue.size != 0)
+    {
+        heapitem current = heapPop(&queue);
+        unsigned long u = current.index;
+        if (current.f > dist[u])
+            continue;
+        if (u == t)
+            break;
+        scanned++;
+
+        // Highest level at which u is in neither the cell of s nor of t
+        unsigned long leafu = crpLeaf(&g, u);
+        int level = 0;
+        for (int l = g.nlevels; l >= 1 && level == 0; l--)
+            if ((leafu >> g.shift[l]) != (leafs >> g.shift[l]) && (leafu >> g.shift[l]) != (leaft >> g.shift[l]))
+                level = l;
+
+        unsigned long nrelax = 0, *to = NULL;
+        unsigned char *cutlevel = NULL;
+        double *w = NULL;
+        signed char kind = 0;
+        for (int pass = 0; pass < 2; pass++)
+        {
+            if (level == 0 && pass == 0)
+            {
+                // Original edges inside the cells of s and t
+                crpcell *cell = crpLoadCell(&g, leafu);
+                unsigned long i = u - g.cellstart[leafu];
+                to = cell->adj + cell->first[i];
+                w = cell->weight + cell->first[i];
+                nrelax = cell->first[i + 1] - cell->first[i];
+                kind = 0;
+            }
+            else if (level > 0 && pass == 0)
+            {
+                // Clique of the level cell of u
+                unsigned long c = leafu >> g.shift[level], b0 = g.bstart[level][c], nb = g.bstart[level][c + 1] - b0;
+                long slot = crpFind(g.bvert[level], b0, b0 + nb, u) - b0;
+                to = g.bvert[level] + b0;
+                w = g.clique[level] + g.cliquestart[level][c] + slot * nb;
+                nrelax = nb;
+                kind = level;
+            }
+            else if (level > 0)
+            {
+                // Cut edges that leave the level cell of u
+                long k = crpOverlay(&g, u);
+                to = g.cuttarget + g.ocut[k];
+                w = g.cutweight + g.ocut[k];
+                cutlevel = g.cutlevel + g.ocut[k];
+                nrelax = g.ocut[k + 1] - g.ocut[k];
+                kind = 0;
+            }
+            else
+                break;
+
+            for (unsigned long j = 0; j < nrelax; j++)
+            {
+                unsigned long v = to[j];
+                if (cutlevel != NULL && cutlevel[j] < level)
+                    continue; // Inside the cell, the clique already covers it
+                double d = current.f + w[j];
+                if (w[j] == INFINITY || (seen[v] && d >= dist[v]))
+                    continue;
+                seen[v] = 1;
+                dist[v] = d;
+                parent[v] = u;
+                parentlevel[v] = kind;
+                heapPush(&queue, d, v);
+            }
+        }
+    }
+    double search_time = wallClock() - start;
+
+    if (!seen[t])
+    {
+        printf("There is no path from %s to %s\n", argv[0], argv[1]);
+        return 3;
+    }
+
+    // Overlay path from t back to s, then every clique edge unpacked
+    nodelist overlay = {NULL, 0, 0}, path = {NULL, 0, 0};
+    for (long v = t; v != -1; v = parent[v])
+        nodelistPush(&overlay, v);
+    nodelistPush(&path, s);
+    for (unsigned long i = overlay.size - 1; i > 0; i--)
+    {
+        unsigned long a = overlay.items[i], b = overlay.items[i - 1];
+        if (parentlevel[b] == 0)
+            nodelistPush(&path, b);
+        else
+            crpUnpack(&g, parentlevel[b], a, b, &path);
+    }
+    printf("Scanned %lu nodes, %lu overlay edges on the path\n", scanned, overlay.size - 1);
+    printf("Search time: %f seconds, with unpacking %f seconds\n", search_time, wallClock() - start);
+
+    // With another profile than dist the cost is not a length: the length is
+    // measured along the path first
+    double length = dist[t], lat = 0, lon = 0;
+    if (strcmp(profilename, "dist") != 0)
+    {
+        length = 0;
+        for (unsigned long i = 0; i < path.size; i++)
+        {
+            unsigned long c = crpLeaf(&g, path.items[i]);
+            crpcell *cell = crpLoadCell(&g, c);
+            unsigned long j = path.items[i] - g.cellstart[c];
+            if (i != 0)
+                length += haversine(lat, lon, cell->lat[j], cell->lon[j]);
+            lat = cell->lat[j];
+            lon = cell->lon[j];
+        }
+    }
+    FILE *pathtxt = fopen("finalpath.txt", "w");
+    if (strcmp(profilename, "dist") != 0)
+        fprintf(pathtxt, "# Distance from %s to %s: %lf meters, cost %lf with the %s profile.\n", argv[0], argv[1], length, dist[t], profilename);
+    else
+        fprintf(pathtxt, "# Distance from %s to %s: %lf meters.\n", argv[0], argv[1], length);
+    fprintf(pathtxt, "# Optimal path:\n");
+    double cumulative_distance = 0;
+    for (unsigned long i = 0; i < path.size; i++)
+    {
+        unsigned long c = crpLeaf(&g, path.items[i]);
+        crpcell *cell = crpLoadCell(&g, c);
+        unsigned long j = path.items[i] - g.cellstart[c];
+        if (i != 0)
+            cumulative_distance += haversine(lat, lon, cell->lat[j], cell->lon[j]);
+        lat = cell->lat[j];
+        lon = cell->lon[j];
+        fprintf(pathtxt, "Id = %lu | %lf | %lf | Dist = %lf\n", cell->id[j], lat, lon, cumulative_distance);
+    }
+    fclose(pathtxt);
+
+    printf("Path of %lu nodes and %lf meters, cost %lf with the %s profile\n", path.size, length, dist[t], profilename);
+    printf("Read %lu of %lu leaf cells (%lu KB)\n", g.cellsloaded, g.ncells, g.bytesread / 1024);
+    return 0;
+}
+
+// Appends the nodes after a of the shortest path from a to b inside their
+// cell at level, which a clique edge of that level stands for.
+void crpUnpack(crpgraph *g, int level, unsigned long a, unsigned long b, nodelist *path)
+{
+    unsigned long cell = crpLeaf(g, a) >> g->shift[level];
+    crpsearch s;
+    memset(&s, 0, sizeof(s));
+    crpCellSearch(g, level, cell, a, &s);
+
+    nodelist steps = {NULL, 0, 0};
+    long from = crpLocal(g, level, cell, a);
+    for (long v = crpLocal(g, level, cell, b); v != from; v = s.parent[v])
+        nodelistPush(&steps, v);
+    for (unsigned long i = steps.size; i > 0; i--)
+    {
+        unsigned long v = steps.items[i - 1], pos = crpPosition(g, level, cell, v);
+        if (s.parentkind[v] == 1)
+            crpUnpack(g, level - 1, crpPosition(g, level, cell, s.parent[v]), pos, path);
+        else
+            nodelistPush(path, pos);
+    }
+    free(steps.items);
+    free(s.dist);
+    free(s.parent);
+    free(s.parentkind);
+    free(s.heap);
+}
+
+#define ARA_OPEN 1
+#define ARA_CLOSED 2
+#define ARA_INCONS 3 // Improved after being expanded in the current iteration
+
+// Anytime repairing A* (ARA*). Runs weighted A* with w, then lowers w by step
+// and repairs the search instead of starting again: only the nodes whose cost
+// improved since their expansion are reopened. After every iteration the path
+// is printed with its suboptimality bound, min(w, g(target) / min g + h over
+// the open and inconsistent nodes). Stops at bound 1 or once budget seconds
+// have passed; the first path is always completed. Returns the cost of the
+// best path, whose bound is left in *bound.
+double araStar(graph *map, search *s, unsigned long origin, unsigned long target, double w, double step, double budget, double *bound, unsigned long *expanded)
+{
+    double tx = map->x[target], ty = map->y[target], tz = map->z[target];
+    double start = wallClock();
+    double *h = (double *)malloc(map->nnodes * sizeof(double));
+    unsigned char *state = (unsigned char *)calloc(map->nnodes, sizeof(unsigned char));
+    nodelist incons = {NULL, 0, 0}, open = {NULL, 0, 0};
+    if (h == NULL || state == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    searchReset(s);
+    *expanded = 0;
+    *bound = INFINITY;
+    s->dist[origin] = 0;
+    s->parent[origin] = -1;
+    s->touched[s->ntouched++] = origin;
+    geo_heuristic(map->x, map->y, map->z, &origin, 1, tx, ty, tz, &h[origin]);
+    h[origin] *= map->hscale;
+    state[origin] = ARA_OPEN;
+    heapPush(&s->queue, w * h[origin], origin);
+
+    int iteration = 0, timeout = 0;
+    while (1)
+    {
+        // ImprovePath: expand while some open node could still improve the target
+        while (s->queue.size != 0)
+        {
+            heapitem top = s->queue.items[0];
+            unsigned long v = top.index;
+            if (state[v] != ARA_OPEN || top.f != s->dist[v] + w * h[v])
+            {
+                heapPop(&s->queue); // Stale entry
+                continue;
+            }
+            if (s->dist[target] <= top.f)
+                break;
+            if (iteration > 0 && (*expanded & 1023) == 0 && wallClock() - start > budget)
+            {
+                timeout = 1;
+                break;
+            }
+            heapPop(&s->queue);
+            state[v] = ARA_CLOSED;
+            (*expanded)++;
+
+            unsigned long *succ = map->adj + map->first[v];
+            unsigned long nsucc = map->first[v + 1] - map->first[v];
+            double *succ_w = map->weight + map->first[v];
+            geo_heuristic(map->x, map->y, map->z, succ, nsucc, tx, ty, tz, s->succ_h);
+            for (unsigned long i = 0; i < nsucc; i++)
+            {
+                unsigned long u = succ[i];
+                double cost = s->dist[v] + succ_w[i];
+                if (cost >= s->dist[u])
+                    continue;
+                if (s->dist[u] == INFINITY)
+                {
+                    s->touched[s->ntouched++] = u;
+                    h[u] = map->hscale * s->succ_h[i];
+                }
+                s->dist[u] = cost;
+                s->parent[u] = v;
+                if (state[u] == ARA_CLOSED || state[u] == ARA_INCONS)
+                {
+                    if (state[u] == ARA_CLOSED)
+                        nodelistPush(&incons, u);
+                    state[u] = ARA_INCONS;
+                }
+                else
+                {
+                    state[u] = ARA_OPEN;
+                    heapPush(&s->queue, cost + w * h[u], u);
+                }
+            }
+        }
+        if (timeout || s->dist[target] == INFINITY)
+            break;
+
+        // Bound of the path: no open or inconsistent node leads to a cheaper one
+        double lower = s->dist[target];
+        for (unsigned long i = 0; i < s->queue.size; i++)
+        {
+            unsigned long v = s->queue.items[i].index;
+            if (state[v] == ARA_OPEN && s->dist[v] + h[v] < lower)
+                lower = s->dist[v] + h[v];
+        }
+        for (unsigned long i = 0; i < incons.size; i++)
+            if (s->dist[incons.items[i]] + h[incons.items[i]] < lower)
+                lower = s->dist[incons.items[i]] + h[incons.items[i]];
+        *bound = fmin(w, lower > 0 ? s->dist[target] / lower : 1);
+        if (*bound < 1)
+            *bound = 1;
+        iteration++;
+        printf("Path %d: cost %lf, w = %.2f, bound %lf, %lu nodes expanded, %f seconds\n", iteration, s->dist[target], w, *bound, *expanded, wallClock() - start);
+        if (*bound <= 1 || wallClock() - start > budget)
+            break;
+
+        // Next iteration: the inconsistent nodes join the open ones, every open
+        // node gets its key with the new w and the closed set is emptied
+        w = fmax(1, w - step);
+        open.size = 0;
+        for (unsigned long i = 0; i < s->queue.size; i++)
+        {
+            unsigned long v = s->queue.items[i].index;
+            if (state[v] == ARA_OPEN)
+                nodelistPush(&open, v);
+        }
+        for (unsigned long i = 0; i < incons.size; i++)
+            nodelistPush(&open, incons.items[i]);
+        incons.size = 0;
+        for (unsigned long i = 0; i < s->ntouched; i++)
+            state[s->touched[i]] = 0;
+        s->queue.size = 0;
+        for (unsigned long i = 0; i < open.size; i++)
+        {
+            unsigned long v = open.items[i];
+            if (state[v] == ARA_OPEN)
+                continue; // Listed twice
+            state[v] = ARA_OPEN;
+            heapPush(&s->queue, s->dist[v] + w * h[v], v);
+        }
+    }
+    free(h);
+    free(state);
+    free(incons.items);
+    free(open.items);
+    return s->dist[target];
+}
+
+// Nodes of the path that ends in target, from the origin (parent -1) on
+void walkPath(long *parent, unsigned long target, nodelist *path)
+{
+    path->size = 0;
+    for (long v = target; v != -1; v = parent[v])
+        nodelistPush(path, v);
+    for (unsigned long i = 0, j = path->size - 1; i < j; i++, j--)
+    {
+        unsigned long tmp = path->items[i];
+        path->items[i] = path->items[j];
+        path->items[j] = tmp;
+    }
+}
+
+// FNV-1a over the topology and the weights of every profile, so a cache never
+// answers with routes computed on another map or another set of weights
+unsigned long graphVersion(graph *map)
+{
+    unsigned long h = 14695981039346656037UL, word;
+    h = (h ^ map->nnodes) * 1099511628211UL;
+    for (int p = 0; p < map->nprofiles; p++)
+    {
+        profile *prof = &map->profiles[p];
+        for (unsigned long i = 0; i <= map->nnodes; i++)
+            h = (h ^ prof->first[i]) * 1099511628211UL;
+        for (unsigned long e = 0; e < prof->header.nedges; e++)
+        {
+            memcpy(&word, &prof->weight[e], sizeof(word));
+            h = (h ^ prof->adj[e]) * 1099511628211UL;
+            h = (h ^ word) * 1099511628211UL;
+        }
+    }
+    return h;
+}
+
+void cacheInit(routecache *c, unsigned long capacity, int hot, graph *map)
+{
+    c->nbuckets = 1024;
+    c->buckets = (cacheentry **)calloc(c->nbuckets, sizeof(cacheentry *));
+    c->origincount = (unsigned char *)calloc(map->nnodes * map->nprofiles, sizeof(unsigned char));
+    if (c->buckets == NULL || c->origincount == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    c->nentries = 0;
+    c->newest = c->oldest = NULL;
+    c->bytes = 0;
+    c->capacity = capacity;
+    c->version = graphVersion(map);
+    c->hot = hot > 255 ? 255 : hot;
+    c->hits = c->treehits = c->misses = c->evictions = c->invalidations = 0;
+}
+
+static inline unsigned long cacheBucket(routecache *c, unsigned long origin, unsigned long target, int profile)
+{
+    unsigned long h = origin * 0x9E3779B97F4A7C15UL ^ target * 0xC2B2AE3D27D4EB4FUL ^ (unsigned long)profile;
+    return (h ^ (h >> 29)) & (c->nbuckets - 1);
+}
+
+// Entry for the key, made the newest one. Entries left from an older graph
+// version are dropped on the way.
+cacheentry *cacheFind(routecache *c, unsigned long origin, unsigned long target, int profile)
+{
+    cacheentry *e = c->buckets[cacheBucket(c, origin, target, profile)];
+    while (e != NULL && (e->origin != origin || e->target != target || e->profile != profile))
+        e = e->next;
+    if (e == NULL)
+        return NULL;
+    if (e->version != c->version)
+    {
+        cacheRemove(c, e);
+        c->invalidations++;
+        return NULL;
+    }
+    if (e != c->newest)
+    {
+        e->newer->older = e->older;
+        if (e->older != NULL)
+            e->older->newer = e->newer;
+        else
+            c->oldest = e->newer;
+        e->newer = NULL;
+        e->older = c->newest;
+        c->newest->newer = e;
+        c->newest = e;
+    }
+    return e;
+}
+
+// Adds e as the newest entry and evicts the oldest ones until the cache fits
+// in its capacity again. An entry larger than the whole cache is not kept.
+void cacheInsert(routecache *c, cacheentry *e)
+{
+    e->version = c->version;
+    if (e->bytes > c->capacity)
+    {
+        free(e->path);
+        free(e->dist);
+        free(e->parent);
+        free(e);
+        return;
+    }
+    if (c->nentries >= c->nbuckets)
+    {
+        // Rehash into twice as many buckets
+        unsigned long oldcount = c->nbuckets;
+        cacheentry **old = c->buckets;
+        c->nbuckets *= 2;
+        c->buckets = (cacheentry **)calloc(c->nbuckets, sizeof(cacheentry *));
+        if (c->buckets == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        for (unsigned long b = 0; b < oldcount; b++)
+            while (old[b] != NULL)
+            {
+                cacheentry *moved = old[b];
+                old[b] = moved->next;
+                unsigned long nb = cacheBucket(c, moved->origin, moved->target, moved->profile);
+                moved->next = c->buckets[nb];
+                c->buckets[nb] = moved;
+            }
+        free(old);
+    }
+    unsigned long b = cacheBucket(c, e->origin, e->target, e->profile);
+    e->next = c->buckets[b];
+    c->buckets[b] = e;
+    e->newer = NULL;
+    e->older = c->newest;
+    if (c->newest != NULL)
+        c->newest->newer = e;
+    else
+        c->oldest = e;
+    c->newest = e;
+    c->nentries++;
+    c->bytes += e->bytes;
+
+    while (c->bytes > c->capacity)
+    {
+        cacheRemove(c, c->oldest);
+        c->evictions++;
+    }
+}
+
+void cacheRemove(routecache *c, cacheentry *e)
+{
+    cacheentry **link = &c->buckets[cacheBucket(c, e->origin, e->target, e->profile)];
+    while (*link != e)
+        link = &(*link)->next;
+    *link = e->next;
+    if (e->newer != NULL)
+        e->newer->older = e->older;
+    else
+        c->newest = e->older;
+    if (e->older != NULL)
+        e->older->newer = e->newer;
+    else
+        c->oldest = e->newer;
+    c->nentries--;
+    c->bytes -= e->bytes;
+    free(e->path);
+    free(e->dist);
+    free(e->parent);
+    free(e);
+}
+
+// Route from origin to target through the cache: a cached route, a walk up the
+// cached tree of the origin, or a new search whose result is cached. Once an
+// origin has been asked for hot times its whole tree is computed instead of a
+// single A*, as long as the tree takes at most 1/CACHE_TREE_SHARE of the cache;
+// otherwise it would be evicted at once. source tells which of them answered.
+double cacheRoute(routecache *c, graph *map, search *s, unsigned long origin, unsigned long target, int profile, nodelist *path, const char **source)
+{
+    cacheentry *e = cacheFind(c, origin, target, profile);
+    if (e != NULL)
+    {
+        c->hits++;
+        *source = "hit";
+        path->size = 0;
+        for (unsigned long i = 0; i < e->npath; i++)
+            nodelistPush(path, e->path[i]);
+        return e->cost;
+    }
+    e = cacheFind(c, origin, CACHE_TREE, profile);
+    if (e != NULL)
+    {
+        c->treehits++;
+        *source = "tree";
+        path->size = 0;
+        if (e->dist[target] != INFINITY)
+            walkPath(e->parent, target, path);
+        return e->dist[target];
+    }
+
+    c->misses++;
+    *source = "miss";
+    unsigned char *count = &c->origincount[(unsigned long)profile * map->nnodes + origin];
+    if (*count < 255)
+        (*count)++;
+    unsigned long treebytes = sizeof(cacheentry) + map->nnodes * (sizeof(double) + sizeof(long));
+    e = (cacheentry *)calloc(1, sizeof(cacheentry));
+    if (e == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    e->origin = origin;
+    e->profile = profile;
+    double cost;
+    if (c->hot > 0 && *count >= c->hot && treebytes <= c->capacity / CACHE_TREE_SHARE)
+    {
+        boundedDijkstra(map, s, origin, INFINITY);
+        e->target = CACHE_TREE;
+        e->dist = (double *)malloc(map->nnodes * sizeof(double));
+        e->parent = (long *)malloc(map->nnodes * sizeof(long));
+        if (e->dist == NULL || e->parent == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(e->dist, s->dist, map->nnodes * sizeof(double));
+        memcpy(e->parent, s->parent, map->nnodes * sizeof(long));
+        e->bytes = treebytes;
+        cost = s->dist[target];
+    }
+    else
+    {
+        unsigned long expanded;
+        cost = aStar(map, s, origin, target, &expanded);
+        e->target = target;
+        e->cost = cost;
+        e->bytes = sizeof(cacheentry);
+    }
+    path->size = 0;
+    if (cost != INFINITY)
+        walkPath(s->parent, target, path);
+    if (e->target != CACHE_TREE && path->size > 0)
+    {
+        e->npath = path->size;
+        e->path = (unsigned long *)malloc(path->size * sizeof(unsigned long));
+        if (e->path == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(e->path, path->items, path->size * sizeof(unsigned long));
+        e->bytes += path->size * sizeof(unsigned long);
+    }
+    cacheInsert(c, e);
+    return cost;
+}
+
+// Answers a file of queries, one "origin target [profile]" line each, through
+// the route cache. A line "reload map.bin" loads another version of the map,
+// which invalidates everything cached so far. Writes queries.txt and the cache
+// counters, which show how large the cache has to be.
+int queriesMode(graph *map, int argc, char *argv[])
+{
+    double capacity = 64;
+    int hot = 4;
+
+    if (argc < 1)
+    {
+        printf("Usage: --queries file [--cache MB] [--hot n]\n");
+        return 1;
+    }
+    for (int a = 1; a < argc; a++)
+    {
+        if (strcmp(argv[a], "--cache") == 0 && a + 1 < argc)
+            capacity = atof(argv[++a]);
+        else if (strcmp(argv[a], "--hot") == 0 && a + 1 < argc)
+            hot = atoi(argv[++a]);
+        else
+        {
+            printf("Unknown option %s\n", argv[a]);
+            return 1;
+        }
+    }
+    FILE *queryfile = fopen(argv[0], "r");
+    if (queryfile == NULL)
+    {
+        printf("Error when opening the file %s\n", argv[0]);
+        return 1;
+    }
+    FILE *resultfile = fopen("queries.txt", "w");
+    if (resultfile == NULL)
+    {
+        printf("Error when opening the file queries.txt\n");
+        return 1;
+    }
+    fprintf(resultfile, "# origin target cost nodes source\n");
+
+    routecache cache;
+    search s;
+    nodelist path = {NULL, 0, 0};
+    cacheInit(&cache, (unsigned long)(capacity * 1024 * 1024), hot, map);
+    searchInit(&s, map);
+
+    char line[1024], mapname[1024];
+    unsigned long nqueries = 0;
+    double start = wallClock();
+    while (fgets(line, sizeof(line), queryfile) != NULL)
+    {
+        if (sscanf(line, "reload %1023s", mapname) == 1)
+        {
+            searchFree(&s);
+            freeGraph(map);
+            if (loadGraph(mapname, map) != 0)
+                return 2;
+            searchInit(&s, map);
+            free(cache.origincount);
+            cache.origincount = (unsigned char *)calloc(map->nnodes * map->nprofiles, sizeof(unsigned char));
+            if (cache.origincount == NULL)
+            {
+                printf("Error when allocating the memory for the cache\n");
+                return 2;
+            }
+            cache.version = graphVersion(map);
+            printf("Reloaded %s, version %016lx\n", mapname, cache.version);
+            continue;
+        }
+        char *fields[3];
+        int nfields = line[0] == '#' ? 0 : splitQuery(line, fields, 3);
+        if (nfields < 2)
+            continue; // Comments and blank lines
+        int p = nfields == 3 ? findProfile(map, fields[2]) : 0;
+        if (p < 0)
+        {
+            printf("Profile %s not found in the map\n", fields[2]);
+            continue;
+        }
+        useProfile(map, p);
+
+        unsigned long origin = findNode(map, fields[0], 0);
+        unsigned long target = findNode(map, fields[1], 0);
+        if (origin == map->nnodes + 1 || target == map->nnodes + 1)
+        {
+            printf("Node %s or %s not found in the map\n", fields[0], fields[1]);
+            continue;
+        }
+        const char *source;
+        double cost = cacheRoute(&cache, map, &s, origin, target, p, &path, &source);
+        fprintf(resultfile, "%lu %lu %lf %lu %s\n", map->nodes[origin].id, map->nodes[target].id, cost, path.size, source);
+        nqueries++;
+    }
+    double elapsed = wallClock() - start;
+    fclose(queryfile);
+    fclose(resultfile);
+
+    printf("Answered %lu queries in %f seconds (%f ms per query)\n", nqueries, elapsed, nqueries ? 1000 * elapsed / nqueries : 0);
+    printf("Hits: %lu | Tree hits: %lu | Misses: %lu | Evictions: %lu | Invalidated: %lu\n",
+           cache.hits, cache.treehits, cache.misses, cache.evictions, cache.invalidations);
+    printf("Cache: %lu entries, %.2f of %.2f MB\n", cache.nentries, cache.bytes / 1048576.0, capacity);
+    return 0;
+}
+
+// Reverse edges of the current profile, for the backward searches
+void transposeGraph(graph *map, unsigned long **rfirst, unsigned long **radj, double **rweight)
+{
+    unsigned long *fill = (unsigned long *)malloc((map->nnodes + 1) * sizeof(unsigned long));
+    *rfirst = (unsigned long *)calloc(map->nnodes + 1, sizeof(unsigned long));
+    *radj = (unsigned long *)malloc((map->nedges + 1) * sizeof(unsigned long));
+    *rweight = (double *)malloc((map->nedges + 1) * sizeof(double));
+    if (fill == NULL || *rfirst == NULL || *radj == NULL || *rweight == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned long e = 0; e < map->nedges; e++)
+        (*rfirst)[map->adj[e] + 1]++;
+    for (unsigned long i = 0; i < map->nnodes; i++)
+        (*rfirst)[i + 1] += (*rfirst)[i];
+    memcpy(fill, *rfirst, map->nnodes * sizeof(unsigned long));
+    for (unsigned long u = 0; u < map->nnodes; u++)
+        for (unsigned long e = map->first[u]; e < map->first[u + 1]; e++)
+        {
+            unsigned long pos = fill[map->adj[e]]++;
+            (*radj)[pos] = u;
+            (*rweight)[pos] = map->weight[e];
+        }
+    free(fill);
+}
+
+// One step of a Dijkstra that settles every node once: pops the closest node
+// not settled yet, relaxes its edges and returns it, or -1 if the queue is empty
+static inline long settleNext(search *s, nodelist *order, unsigned long *first, unsigned long *adj, double *weight)
+{
+    while (s->queue.size != 0)
+    {
+        heapitem current = heapPop(&s->queue);
+        if (s->closed[current.index])
+            continue; // Stale entry
+        s->closed[current.index] = 1;
+        nodelistPush(order, current.index);
+        for (unsigned long e = first[current.index]; e < first[current.index + 1]; e++)
+        {
+            unsigned long succ_index = adj[e];
+            double succ_dist = current.f + weight[e];
+            if (succ_dist >= s->dist[succ_index])
+                continue;
+            if (s->dist[succ_index] == INFINITY)
+                s->touched[s->ntouched++] = succ_index;
+            s->dist[succ_index] = succ_dist;
+            s->parent[succ_index] = current.index;
+            heapPush(&s->queue, succ_dist, succ_index);
+        }
+        return current.index;
+    }
+    return -1;
+}
+
+// The path through v: the forward tree from the origin to v and then the
+// backward tree from v to the target. cost gets the cost up to every node.
+void viaPath(search *fw, search *bw, unsigned long v, nodelist *path, double *cost)
+{
+    walkPath(fw->parent, v, path);
+    for (unsigned long i = 0; i < path->size; i++)
+        cost[i] = fw->dist[path->items[i]];
+    for (long u = bw->parent[v]; u != -1; u = bw->parent[u])
+    {
+        cost[path->size] = fw->dist[v] + bw->dist[v] - bw->dist[u];
+        nodelistPush(path, u);
+    }
+}
+
+int compareHeapItems(const void *a, const void *b)
+{
+    const heapitem *ia = a, *ib = b;
+    return (ia->f > ib->f) - (ia->f < ib->f);
+}
+
+#define ALT_MAX 8           // Routes reported at most, the best one included
+#define ALT_CANDIDATES 1000 // Via nodes examined at most
+
+// Alternative routes with the via-node method. A bidirectional Dijkstra runs
+// until both searches pass (1 + stretch) times the shortest distance d; every
+// node v settled by both gives the route origin -> v -> target of length
+// df(v) + db(v). They are ranked by length, sharing with the best route and
+// plateau length (stretches where both trees follow the same edges), and a
+// candidate is taken if it is simple, shares at most sharing * d with every
+// route taken so far and passes the T-test: the part of it within local * d
+// of v must be a shortest path. Writes alternatives.txt.
+int alternativesMode(graph *map, int argc, char *argv[])
+{
+    int count = 2;
+    double stretch = 0.25, sharing = 0.8, local = 0.25;
+
+    if (argc < 2)
+    {
+        printf("Usage: --alt origin target [--count n] [--stretch e] [--sharing g] [--local a]\n");
+        return 1;
+    }
+    unsigned long origin = findNode(map, argv[0], 1);
+    unsigned long target = findNode(map, argv[1], 1);
+    if (origin == map->nnodes + 1 || target == map->nnodes + 1)
+    {
+        printf("Origin or target node not found in the map\n");
+        return 1;
+    }
+    for (int a = 2; a < argc; a++)
+    {
+        if (strcmp(argv[a], "--count") == 0 && a + 1 < argc)
+            count = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--stretch") == 0 && a + 1 < argc)
+            stretch = atof(argv[++a]);
+        else if (strcmp(argv[a], "--sharing") == 0 && a + 1 < argc)
+            sharing = atof(argv[++a]);
+        else if (strcmp(argv[a], "--local") == 0 && a + 1 < argc)
+            local = atof(argv[++a]);
+        else
+        {
+            printf("Unknown option %s\n", argv[a]);
+            return 1;
+        }
+    }
+    if (count < 0)
+        count = 0;
+    if (count > ALT_MAX - 1)
+        count = ALT_MAX - 1;
+
+    unsigned long *rfirst, *radj;
+    double *rweight;
+    transposeGraph(map, &rfirst, &radj, &rweight);
+
+    search fw, bw, check;
+    searchInit(&fw, map);
+    searchInit(&bw, map);
+    searchInit(&check, map);
+    nodelist forder = {NULL, 0, 0}, border = {NULL, 0, 0}, path = {NULL, 0, 0};
+    double *up = (double *)malloc(map->nnodes * sizeof(double));
+    double *down = (double *)malloc(map->nnodes * sizeof(double));
+    double *sf = (double *)malloc(map->nnodes * sizeof(double));
+    double *sb = (double *)malloc(map->nnodes * sizeof(double));
+    double *cost = (double *)malloc(map->nnodes * sizeof(double));
+    long *pos = (long *)malloc(map->nnodes * sizeof(long));
+    if (up == NULL || down == NULL || sf == NULL || sb == NULL || cost == NULL || pos == NULL)
+    {
+        printf("Error when allocating the memory for the alternative routes\n");
+        return 2;
+    }
+    for (unsigned long i = 0; i < map->nnodes; i++)
+        pos[i] = -1;
+
+    double start = wallClock();
+    fw.dist[origin] = 0;
+    fw.parent[origin] = -1;
+    fw.touched[fw.ntouched++] = origin;
+    heapPush(&fw.queue, 0, origin);
+    bw.dist[target] = 0;
+    bw.parent[target] = -1;
+    bw.touched[bw.ntouched++] = target;
+    heapPush(&bw.queue, 0, target);
+
+    // Bidirectional search. mu is the best origin-target distance seen, and it
+    // is exact long before either side passes (1 + stretch) * mu.
+    double mu = INFINITY;
+    long meet = -1;
+    int fdone = 0, bdone = 0;
+    while (!fdone || !bdone)
+    {
+        int forward = bdone || (!fdone && (bw.queue.size == 0 || (fw.queue.size != 0 && fw.queue.items[0].f <= bw.queue.items[0].f)));
+        search *cur = forward ? &fw : &bw, *other = forward ? &bw : &fw;
+        if (cur->queue.size == 0 || cur->queue.items[0].f > (1 + stretch) * mu)
+        {
+            if (forward)
+                fdone = 1;
+            else
+                bdone = 1;
+            continue;
+        }
+        long v = forward ? settleNext(&fw, &forder, map->first, map->adj, map->weight) : settleNext(&bw, &border, rfirst, radj, rweight);
+        if (v >= 0 && other->dist[v] + cur->dist[v] < mu)
+        {
+            mu = other->dist[v] + cur->dist[v];
+            meet = v;
+        }
+    }
+    if (meet < 0)
+    {
+        printf("There is no path from %lu to %lu\n", map->nodes[origin].id, map->nodes[target].id);
+        return 3;
+    }
+
+    // The best route, and the length each tree path shares with it
+    nodelist routes[ALT_MAX];
+    double *routecost[ALT_MAX], routeshared[ALT_MAX];
+    int nroutes = 0;
+    viaPath(&fw, &bw, meet, &path, cost);
+    for (unsigned long i = 0; i < path.size; i++)
+        pos[path.items[i]] = i;
+    sf[origin] = up[origin] = 0;
+    for (unsigned long i = 1; i < forder.size; i++)
+    {
+        unsigned long v = forder.items[i], p = fw.parent[v];
+        double w = fw.dist[v] - fw.dist[p];
+        sf[v] = sf[p] + (pos[p] >= 0 && pos[v] == pos[p] + 1 ? w : 0);
+        up[v] = bw.dist[p] != INFINITY && bw.parent[p] == (long)v ? up[p] + w : 0;
+    }
+    sb[target] = down[target] = 0;
+    for (unsigned long i = 1; i < border.size; i++)
+    {
+        unsigned long v = border.items[i], c = bw.parent[v];
+        double w = bw.dist[v] - bw.dist[c];
+        sb[v] = sb[c] + (pos[v] >= 0 && pos[c] == pos[v] + 1 ? w : 0);
+        down[v] = fw.dist[c] != INFINITY && fw.parent[c] == (long)v ? down[c] + w : 0;
+    }
+
+    // Via nodes within the stretch, off the best route, best score first
+    heapitem *candidates = (heapitem *)malloc((forder.size + 1) * sizeof(heapitem));
+    unsigned long ncandidates = 0;
+    if (candidates == NULL)
+    {
+        printf("Error when allocating the memory for the alternative routes\n");
+        return 2;
+    }
+    for (unsigned long i = 0; i < forder.size; i++)
+    {
+        unsigned long v = forder.items[i];
+        double length = fw.dist[v] + bw.dist[v];
+        if (!bw.closed[v] || pos[v] >= 0 || length > (1 + stretch) * mu || sf[v] + sb[v] > sharing * mu)
+            continue;
+        candidates[ncandidates].f = 2 * length + sf[v] + sb[v] - up[v] - down[v];
+        candidates[ncandidates++].index = v;
+    }
+    qsort(candidates, ncandidates, sizeof(heapitem), compareHeapItems);
+    for (unsigned long i = 0; i < path.size; i++)
+        pos[path.items[i]] = -1;
+
+    routes[0] = path;
+    routecost[0] = (double *)malloc(path.size * sizeof(double));
+    memcpy(routecost[0], cost, path.size * sizeof(double));
+    routeshared[0] = mu;
+    nroutes = 1;
+    path.items = NULL;
+    path.size = path.capacity = 0;
+
+    unsigned long examined = 0, ttests = 0;
+    for (unsigned long c = 0; c < ncandidates && examined < ALT_CANDIDATES && nroutes <= count; c++)
+    {
+        unsigned long v = candidates[c].index;
+        examined++;
+        viaPath(&fw, &bw, v, &path, cost);
+        unsigned long iv = 0;
+        while (path.items[iv] != v)
+            iv++;
+
+        // Simple path, and limited sharing with every route taken
+        int ok = 1;
+        for (unsigned long i = 0; i < path.size && ok; i++)
+        {
+            if (pos[path.items[i]] >= 0)
+                ok = 0;
+            pos[path.items[i]] = i;
+        }
+        for (unsigned long i = 0; i < path.size; i++)
+            pos[path.items[i]] = -1;
+        double shared0 = 0;
+        for (int r = 0; r < nroutes && ok; r++)
+        {
+            double shared = 0;
+            for (unsigned long i = 0; i < routes[r].size; i++)
+                pos[routes[r].items[i]] = i;
+            for (unsigned long i = 0; i + 1 < path.size; i++)
+                if (pos[path.items[i]] >= 0 && pos[path.items[i + 1]] == pos[path.items[i]] + 1)
+                    shared += cost[i + 1] - cost[i];
+            for (unsigned long i = 0; i < routes[r].size; i++)
+                pos[routes[r].items[i]] = -1;
+            if (shared > sharing * mu)
+                ok = 0;
+            if (r == 0)
+                shared0 = shared;
+        }
+        if (!ok)
+            continue;
+
+        // T-test around v
+        unsigned long x = iv, y = iv;
+        while (x > 0 && cost[iv] - cost[x] < local * mu)
+            x--;
+        while (y + 1 < path.size && cost[y] - cost[iv] < local * mu)
+            y++;
+        ttests++;
+        boundedDijkstra(map, &check, path.items[x], cost[y] - cost[x]);
+        if (check.dist[path.items[y]] < (cost[y] - cost[x]) * (1 - 1e-12))
+            continue;
+
+        routes[nroutes] = path;
+        routecost[nroutes] = (double *)malloc(path.size * sizeof(double));
+        memcpy(routecost[nroutes], cost, path.size * sizeof(double));
+        routeshared[nroutes] = shared0;
+        nroutes++;
+        path.items = NULL;
+        path.size = path.capacity = 0;
+    }
+    double elapsed = wallClock() - start;
+
+    // The same query as a single shortest path search, for comparison
+    unsigned long expanded;
+    double t = wallClock();
+    aStar(map, &check, origin, target, &expanded);
+    double single = wallClock() - t;
+
+    const char *unit = map->profiles[map->current].header.unit;
+    FILE *alttxt = fopen("alternatives.txt", "w");
+    if (alttxt == NULL)
+    {
+        printf("Error when opening alternatives.txt\n");
+        return 1;
+    }
+    for (int r = 0; r < nroutes; r++)
+    {
+        double length = routecost[r][routes[r].size - 1];
+        printf("Route %d: %lf %s (+%.1f%%), %.1f%% shared with the best route\n", r, length, unit, 100 * (length / mu - 1), 100 * routeshared[r] / mu);
+        fprintf(alttxt, "# Route %d from %lu to %lu: %lf %s, %.1f%% shared with the best route.\n", r, map->nodes[origin].id, map->nodes[target].id, length, unit, 100 * routeshared[r] / mu);
+        for (unsigned long i = 0; i < routes[r].size; i++)
+        {
+            node *n = &map->nodes[routes[r].items[i]];
+            fprintf(alttxt, "Id = %lu | %lf | %lf | Dist = %lf\n", n->id, n->lat, n->lon, routecost[r][i]);
+        }
+    }
+    fclose(alttxt);
+    printf("Settled %lu + %lu nodes, %lu via nodes in the stretch, %lu examined, %lu T-tests\n", forder.size, border.size, ncandidates, examined, ttests);
+    printf("Alternative routes: %f seconds | Single A*: %f seconds, %lu nodes expanded | Extra cost: %.1fx\n", elapsed, single, expanded, single > 0 ? elapsed / single : 0);
+    return 0;
+}
+
+double wallClock(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+typedef struct
+{
+    double lon, lat;
+    unsigned long index;
+} hullpoint;
+
+int compareHullPoints(const void *a, const void *b);
+
+// Convex hull (Andrew's monotone chain on lon/lat) of the given nodes, written
+// counterclockwise into hull, which needs room for npoints + 1 entries.
+// Returns the number of vertices.
+int convexHull(graph *map, unsigned long *points, unsigned long npoints, unsigned long *hull)
+{
+    hullpoint *sorted = (hullpoint *)malloc((npoints + 1) * sizeof(hullpoint));
+    for (unsigned long i = 0; i < npoints; i++)
+    {
+        sorted[i].lon = map->nodes[points[i]].lon;
+        sorted[i].lat = map->nodes[points[i]].lat;
+        sorted[i].index = points[i];
+    }
+    qsort(sorted, npoints, sizeof(hullpoint), compareHullPoints);
+
+    if (npoints < 3)
+    {
+        for (unsigned long i = 0; i < npoints; i++)
+            hull[i] = sorted[i].index;
+        free(sorted);
+        return npoints;
+    }
+
+    hullpoint *h = (hullpoint *)malloc((npoints + 1) * sizeof(hullpoint));
+    long k = 0;
+    // Lower hull, then upper hull
+    for (long i = 0; i < (long)npoints; i++)
+    {
+        while (k >= 2 && (h[k - 1].lon - h[k - 2].lon) * (sorted[i].lat - h[k - 2].lat) - (h[k - 1].lat - h[k - 2].lat) * (sorted[i].lon - h[k - 2].lon) <= 0)
+            k--;
+        h[k++] = sorted[i];
+    }
+    for (long i = npoints - 2, lower = k + 1; i >= 0; i--)
+    {
+        while (k >= lower && (h[k - 1].lon - h[k - 2].lon) * (sorted[i].lat - h[k - 2].lat) - (h[k - 1].lat - h[k - 2].lat) * (sorted[i].lon - h[k - 2].lon) <= 0)
+            k--;
+        h[k++] = sorted[i];
+    }
+    for (long i = 0; i < k - 1; i++) // The first point is repeated at the end
+        hull[i] = h[i].index;
+    free(sorted);
+    free(h);
+    return k - 1;
+}
+
+int compareHullPoints(const void *a, const void *b)
+{
+    const hullpoint *pa = a, *pb = b;
+    if (pa->lon != pb->lon)
+        return pa->lon < pb->lon ? -1 : 1;
+    if (pa->lat != pb->lat)
+        return pa->lat < pb->lat ? -1 : 1;
+    return 0;
+}
+
+// Copy of the arrays of the current profile that the searches read, bound to
+// a NUMA node (-1 for none) and backed by pages of the given size. The rest of
+// the struct is shared with map.
+int replicateGraph(graph *map, graph *replica, int huge, int node)
+{
+    *replica = *map;
+    replica->huge = huge;
+    replica->first = (unsigned long *)placeAlloc((map->nnodes + 1) * sizeof(unsigned long), huge, node);
+    replica->adj = (unsigned long *)placeAlloc((map->nedges + 1) * sizeof(unsigned long), huge, node);
+    replica->weight = (double *)placeAlloc((map->nedges + 1) * sizeof(double), huge, node);
+    replica->x = (double *)placeAlloc(map->nnodes * sizeof(double), huge, node);
+    replica->y = (double *)placeAlloc(map->nnodes * sizeof(double), huge, node);
+    replica->z = (double *)placeAlloc(map->nnodes * sizeof(double), huge, node);
+    if (replica->first == NULL || replica->adj == NULL || replica->weight == NULL || replica->x == NULL || replica->y == NULL || replica->z == NULL)
+        return 2;
+    // The copies are the first touch, so the pages land on the bound node
+    memcpy(replica->first, map->first, (map->nnodes + 1) * sizeof(unsigned long));
+    memcpy(replica->adj, map->adj, map->nedges * sizeof(unsigned long));
+    memcpy(replica->weight, map->weight, map->nedges * sizeof(double));
+    memcpy(replica->x, map->x, map->nnodes * sizeof(double));
+    memcpy(replica->y, map->y, map->nnodes * sizeof(double));
+    memcpy(replica->z, map->z, map->nnodes * sizeof(double));
+    return 0;
+}
+
+void freeReplica(graph *replica, int node)
+{
+    placeFree(replica->first, (replica->nnodes + 1) * sizeof(unsigned long), replica->huge, node);
+    placeFree(replica->adj, (replica->nedges + 1) * sizeof(unsigned long), replica->huge, node);
+    placeFree(replica->weight, (replica->nedges + 1) * sizeof(double), replica->huge, node);
+    placeFree(replica->x, replica->nnodes * sizeof(double), replica->huge, node);
+    placeFree(replica->y, replica->nnodes * sizeof(double), replica->huge, node);
+    placeFree(replica->z, replica->nnodes * sizeof(double), replica->huge, node);
+}
+
+typedef struct
+{
+    graph *map;
+    unsigned long *pairs; // origin, target, origin, target ...
+    int nqueries, first, step;
+    int node; // NUMA node to pin the thread to, -1 for none
+    double cost;
+    long long tlbmisses;
+} benchjob;
+
+// Runs the queries first, first + step ... with its own search state, which
+// it allocates after pinning so that the state is local too
+void *benchMemWorker(void *arg)
+{
+    benchjob *job = (benchjob *)arg;
+    search s;
+    unsigned long expanded;
+
+    if (job->node >= 0)
+        pinThread(job->node);
+    searchInit(&s, job->map);
+    int fd = perfOpenTlb();
+    job->cost = 0;
+    for (int q = job->first; q < job->nqueries; q += job->step)
+    {
+        double c = aStar(job->map, &s, job->pairs[2 * q], job->pairs[2 * q + 1], &expanded);
+        if (c != INFINITY)
+            job->cost += c;
+    }
+    job->tlbmisses = perfRead(fd);
+    if (fd >= 0)
+        close(fd);
+    searchFree(&s);
+    return NULL;
+}
+
+// Throughput and data TLB misses of random A* queries on nthreads threads,
+// with the graph on 4k pages, transparent and explicit huge pages, either one
+// shared copy or one replica per NUMA node with pinned threads
+void benchMem(graph *map, int nqueries, int nthreads)
+{
+    if (nqueries < 1)
+        nqueries = 1;
+    if (nthreads < 1)
+        nthreads = 1;
+    int nnuma = numaNodes();
+    unsigned long *pairs = (unsigned long *)malloc(2 * nqueries * sizeof(unsigned long));
+    benchjob *jobs = (benchjob *)malloc(nthreads * sizeof(benchjob));
+    pthread_t *ids = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+    graph *replicas = (graph *)malloc(nnuma * sizeof(graph));
+    if (pairs == NULL || jobs == NULL || ids == NULL || replicas == NULL)
+    {
+        printf("Error when allocating the memory for the benchmark\n");
+        return;
+    }
+    unsigned int seed = 12345;
+    for (int q = 0; q < 2 * nqueries; q++)
+        pairs[q] = rand_r(&seed) % map->nnodes;
+
+    int hugetlb = placeInit(PLACE_HUGETLB) == PLACE_HUGETLB;
+    printf("%d queries on %d threads, %d NUMA nodes\n", nqueries, nthreads, nnuma);
+    printf("%-10s %-12s %10s %12s %16s\n", "pages", "placement", "seconds", "queries/s", "dTLB misses/q");
+    double reference = -1;
+    for (int huge = PLACE_MALLOC; huge <= PLACE_HUGETLB; huge++)
+    {
+        if (huge == PLACE_HUGETLB && !hugetlb)
+            continue;
+        for (int numa = 0; numa <= 1; numa++)
+        {
+            int ncopies = numa ? nnuma : 1, ok = 1;
+            for (int r = 0; r < ncopies; r++)
+                ok = ok && replicateGraph(map, &replicas[r], huge, numa ? r : -1) == 0;
+            if (!ok)
+            {
+                printf("%-10s %-12s could not allocate the graph\n", place_names[huge], numa ? "per node" : "shared");
+                continue;
+            }
+
+            double start = wallClock();
+            for (int t = 0; t < nthreads; t++)
+            {
+                jobs[t].map = &replicas[numa ? t % nnuma : 0];
+                jobs[t].pairs = pairs;
+                jobs[t].nqueries = nqueries;
+                jobs[t].first = t;
+                jobs[t].step = nthreads;
+                jobs[t].node = numa ? t % nnuma : -1;
+                pthread_create(&ids[t], NULL, benchMemWorker, &jobs[t]);
+            }
+            double cost = 0;
+            long long misses = 0;
+            for (int t = 0; t < nthreads; t++)
+            {
+                pthread_join(ids[t], NULL);
+                cost += jobs[t].cost;
+                misses = jobs[t].tlbmisses < 0 || misses < 0 ? -1 : misses + jobs[t].tlbmisses;
+            }
+            double seconds = wallClock() - start;
+
+            if (reference < 0)
+                reference = cost;
+            char tlb[32] = "n/a";
+            if (misses >= 0)
+                snprintf(tlb, sizeof(tlb), "%.0f", (double)misses / nqueries);
+            printf("%-10s %-12s %10f %12.1f %16s%s\n", place_names[huge], numa ? "per node" : "shared", seconds, nqueries / seconds, tlb,
+                   fabs(cost - reference) > 1e-6 * reference ? "  DIFFERENT RESULTS" : "");
+            for (int r = 0; r < ncopies; r++)
+                freeReplica(&replicas[r], numa ? r : -1);
+        }
+    }
+    free(pairs);
+    free(jobs);
+    free(ids);
+    free(replicas);
+}
+
+// Advances the query of m by one stage. A finished machine takes the next
+// query of its job (first, first + step ...), counted by *next.
+void machineStep(graph *map, querymachine *m, batchjob *job, int *next)
+{
+    search *s = &m->s;
+    switch (m->state)
+    {
+    case QM_START:
+    {
+        if (*next >= job->nqueries)
+        {
+            m->state = QM_DONE;
+            return;
+        }
+        m->query = *next;
+        *next += job->step;
+        unsigned long origin = job->pairs[2 * m->query];
+        double h;
+        m->target = job->pairs[2 * m->query + 1];
+        m->tx = map->x[m->target];
+        m->ty = map->y[m->target];
+        m->tz = map->z[m->target];
+        searchReset(s);
+        s->dist[origin] = 0;
+        s->parent[origin] = -1;
+        s->touched[s->ntouched++] = origin;
+        geo_heuristic(map->x, map->y, map->z, &origin, 1, m->tx, m->ty, m->tz, &h);
+        heapPush(&s->queue, map->hscale * h, origin);
+        m->state = QM_POP;
+        return;
+    }
+    case QM_POP:
+        while (s->queue.size != 0 && s->closed[s->queue.items[0].index])
+            heapPop(&s->queue); // Stale entries
+        if (s->queue.size == 0 || s->queue.items[0].index == m->target)
+        {
+            job->cost[m->query] = s->dist[m->target];
+            m->state = QM_START;
+            return;
+        }
+        m->v = heapPop(&s->queue).index;
+        s->closed[m->v] = 1;
+        m->expanded++;
+        {
+            unsigned long begin = map->first[m->v], end = map->first[m->v + 1];
+            for (unsigned long i = begin; i < end; i += 8)
+            {
+                __builtin_prefetch(&map->adj[i]);
+                __builtin_prefetch(&map->weight[i]);
+            }
+            if (end > begin)
+            {
+                // The last line of the range, which the stride can skip
+                __builtin_prefetch(&map->adj[end - 1]);
+                __builtin_prefetch(&map->weight[end - 1]);
+            }
+        }
+        m->state = QM_SUCC;
+        return;
+    case QM_SUCC:
+        for (unsigned long e = map->first[m->v]; e < map->first[m->v + 1]; e++)
+        {
+            unsigned long u = map->adj[e];
+            __builtin_prefetch(&map->x[u]);
+            __builtin_prefetch(&map->y[u]);
+            __builtin_prefetch(&map->z[u]);
+            __builtin_prefetch(&s->dist[u], 1);
+            __builtin_prefetch(&s->parent[u], 1);
+        }
+        m->state = QM_RELAX;
+        return;
+    case QM_RELAX:
+    {
+        unsigned long *succ = map->adj + map->first[m->v];
+        unsigned long nsucc = map->first[m->v + 1] - map->first[m->v];
+        double *succ_w = map->weight + map->first[m->v];
+        geo_heuristic(map->x, map->y, map->z, succ, nsucc, m->tx, m->ty, m->tz, s->succ_h);
+        for (unsigned long i = 0; i < nsucc; i++)
+        {
+            unsigned long u = succ[i];
+            double cost = s->dist[m->v] + succ_w[i];
+            if (cost < s->dist[u])
+            {
+                if (s->dist[u] == INFINITY)
+                    s->touched[s->ntouched++] = u;
+                s->dist[u] = cost;
+                s->parent[u] = m->v;
+                heapPush(&s->queue, cost + map->hscale * s->succ_h[i], u);
+            }
+        }
+        if (s->queue.size != 0)
+        {
+            unsigned long top = s->queue.items[0].index;
+            __builtin_prefetch(&s->closed[top], 1);
+            __builtin_prefetch(&map->first[top]);
+        }
+        m->state = QM_POP;
+        return;
+    }
+    }
+}
+
+// Runs the queries of a job. With width 1 it is plain A* one query after the
+// other; otherwise width state machines take turns, one stage each.
+void *batchWorker(void *arg)
+{
+    batchjob *job = (batchjob *)arg;
+    graph *map = job->map;
+    job->expanded = 0;
+    if (job->width <= 1)
+    {
+        search s;
+        unsigned long expanded;
+        searchInit(&s, map);
+        for (int q = job->first; q < job->nqueries; q += job->step)
+        {
+            job->cost[q] = aStar(map, &s, job->pairs[2 * q], job->pairs[2 * q + 1], &expanded);
+            job->expanded += expanded;
+        }
+        searchFree(&s);
+        return NULL;
+    }
+
+    querymachine *machines = (querymachine *)malloc(job->width * sizeof(querymachine));
+    if (machines == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int k = 0; k < job->width; k++)
+    {
+        machines[k].state = QM_START;
+        machines[k].expanded = 0;
+        searchInit(&machines[k].s, map);
+    }
+    int next = job->first, active = job->width;
+    while (active > 0)
+    {
+        active = 0;
+        for (int k = 0; k < job->width; k++)
+            if (machines[k].state != QM_DONE)
+            {
+                machineStep(map, &machines[k], job, &next);
+                active++;
+            }
+    }
+    for (int k = 0; k < job->width; k++)
+    {
+        job->expanded += machines[k].expanded;
+        searchFree(&machines[k].s);
+    }
+    free(machines);
+    return NULL;
+}
+
+// Runs the queries on nthreads threads with width interleaved queries each and
+// returns the elapsed seconds
+double runBatch(graph *map, unsigned long *pairs, double *cost, int nqueries, int nthreads, int width, unsigned long *expanded)
+{
+    batchjob *jobs = (batchjob *)malloc(nthreads * sizeof(batchjob));
+    pthread_t *ids = (pthread_t *)malloc(nthreads * sizeof(pthread_t));
+    if (jobs == NULL || ids == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    double start = wallClock();
+    for (int t = 0; t < nthreads; t++)
+    {
+        jobs[t].map = map;
+        jobs[t].pairs = pairs;
+        jobs[t].cost = cost;
+        jobs[t].nqueries = nqueries;
+        jobs[t].first = t;
+        jobs[t].step = nthreads;
+        jobs[t].width = width;
+        pthread_create(&ids[t], NULL, batchWorker, &jobs[t]);
+    }
+    *expanded = 0;
+    for (int t = 0; t < nthreads; t++)
+    {
+        pthread_join(ids[t], NULL);
+        *expanded += jobs[t].expanded;
+    }
+    double seconds = wallClock() - start;
+    free(jobs);
+    free(ids);
+    return seconds;
+}
+
+// Many A* queries at once: random pairs, or "origin target" lines from a file.
+// Compares one query at a time per thread with the interleaved engine at
+// widths 2, 4 ... up to --width, on the same number of threads, and checks
+// that every query gets the same cost.
+int batchMode(graph *map, int argc, char *argv[])
+{
+    int nqueries = 200, width = 8, nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned long *pairs = NULL;
+
+    if (argc < 1)
+    {
+        printf("Usage: --batch queries|@file [--width k] [--threads n]\n");
+        return 1;
+    }
+    for (int a = 1; a < argc; a++)
+    {
+        if (strcmp(argv[a], "--width") == 0 && a + 1 < argc)
+            width = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--threads") == 0 && a + 1 < argc)
+            nthreads = atoi(argv[++a]);
+        else
+        {
+            printf("Unknown option %s\n", argv[a]);
+            return 1;
+        }
+    }
+    if (width < 1)
+        width = 1;
+    if (nthreads < 1)
+        nthreads = 1;
+
+    if (argv[0][0] == '@')
+    {
+        FILE *queryfile = fopen(argv[0] + 1, "r");
+        if (queryfile == NULL)
+        {
+            printf("Error when opening the file %s\n", argv[0] + 1);
+            return 1;
+        }
+        char line[1024], *fields[2];
+        int capacity = 0;
+        nqueries = 0;
+        while (fgets(line, sizeof(line), queryfile) != NULL)
+        {
+            if (line[0] == '#' || splitQuery(line, fields, 2) != 2)
+                continue;
+            unsigned long origin = findNode(map, fields[0], 0);
+            unsigned long target = findNode(map, fields[1], 0);
+            if (origin == map->nnodes + 1 || target == map->nnodes + 1)
+            {
+                printf("Node %s or %s not found in the map\n", fields[0], fields[1]);
+                continue;
+            }
+            if (nqueries == capacity)
+            {
+                capacity = capacity ? 2 * capacity : 256;
+                pairs = realloc(pairs, 2 * capacity * sizeof(unsigned long));
+                if (pairs == NULL)
+                {
+                    printf("Error when allocating the memory for the queries\n");
+                    return 2;
+                }
+            }
+            pairs[2 * nqueries] = origin;
+            pairs[2 * nqueries + 1] = target;
+            nqueries++;
+        }
+        fclose(queryfile);
+    }
+    else
+    {
+        nqueries = atoi(argv[0]);
+        pairs = (unsigned long *)malloc((2 * nqueries + 2) * sizeof(unsigned long));
+        if (pairs == NULL)
+        {
+            printf("Error when allocating the memory for the queries\n");
+            return 2;
+        }
+        unsigned int seed = 12345;
+        for (int q = 0; q < 2 * nqueries; q++)
+            pairs[q] = rand_r(&seed) % map->nnodes;
+    }
+    if (nqueries < 1)
+    {
+        printf("No queries given\n");
+        return 1;
+    }
+
+    double *reference = (double *)malloc(nqueries * sizeof(double));
+    double *cost = (double *)malloc(nqueries * sizeof(double));
+    if (reference == NULL || cost == NULL)
+    {
+        printf("Error when allocating the memory for the results\n");
+        return 2;
+    }
+    unsigned long expanded;
+    printf("%d queries on %d threads\n", nqueries, nthreads);
+    printf("%8s %12s %12s %16s %10s %10s\n", "width", "seconds", "queries/s", "per core q/s", "speedup", "identical");
+    double single = runBatch(map, pairs, reference, nqueries, nthreads, 1, &expanded);
+    printf("%8d %12f %12.1f %16.1f %10.2f %10s\n", 1, single, nqueries / single, nqueries / single / nthreads, 1.0, "yes");
+    for (int k = 2; k <= width; k *= 2)
+    {
+        double seconds = runBatch(map, pairs, cost, nqueries, nthreads, k, &expanded);
+        int identical = memcmp(cost, reference, nqueries * sizeof(double)) == 0;
+        printf("%8d %12f %12.1f %16.1f %10.2f %10s\n", k, seconds, nqueries / seconds, nqueries / seconds / nthreads, single / seconds, identical ? "yes" : "NO");
+    }
+    printf("%lu nodes expanded per pass\n", expanded);
+    free(pairs);
+    free(reference);
+    free(cost);
+    return 0;
+}
+
+// Compares the geodesic kernels with haversine() on every edge of the map, and
+// the batched heuristic with the per-successor sqrt the search used before.
+void benchGeo(graph *map, int repeats)
+{
+    unsigned long nedges = map->nedges, target = map->nnodes / 2;
+    unsigned long *from = (unsigned long *)malloc((nedges + 1) * sizeof(unsigned long));
+    double *reference = (double *)malloc((nedges + 1) * sizeof(double));
+    double *out = (double *)malloc((nedges + 1) * sizeof(double));
+    node *nodes = map->nodes;
+    clock_t start_time;
+    double seconds, checksum = 0;
+
+    if (from == NULL || reference == NULL || out == NULL || repeats < 1)
+    {
+        printf("Error when preparing the benchmark\n");
+        return;
+    }
+    for (unsigned long i = 0; i < map->nnodes; i++)
+        for (unsigned long e = map->first[i]; e < map->first[i + 1]; e++)
+            from[e] = i;
+
+    printf("Benchmark over %lu edges, %d repeats\n", nedges, repeats);
+    printf("%-24s %12s %14s %14s\n", "kernel", "ns/edge", "max abs err m", "max rel err");
+
+    start_time = clock();
+    for (int r = 0; r < repeats; r++)
+        for (unsigned long e = 0; e < nedges; e++)
+            reference[e] = haversine(nodes[from[e]].lat, nodes[from[e]].lon, nodes[map->adj[e]].lat, nodes[map->adj[e]].lon);
+    seconds = (double)(clock() - start_time) / CLOCKS_PER_SEC;
+    printf("%-24s %12.2f %14s %14s\n", "haversine()", seconds * 1e9 / ((double)nedges * repeats), "-", "-");
+
+    geo_kernel list[3];
+    int nkernels = geo_available_kernels(list);
+    for (int k = 0; k < nkernels; k++)
+    {
+        double maxabs = 0, maxrel = 0;
+        start_time = clock();
+        for (int r = 0; r < repeats; r++)
+            list[k].distance(map->x, map->y, map->z, from, map->adj, nedges, out);
+        seconds = (double)(clock() - start_time) / CLOCKS_PER_SEC;
+        for (unsigned long e = 0; e < nedges; e++)
+        {
+            double err = fabs(out[e] - reference[e]);
+            if (err > maxabs)
+                maxabs = err;
+            if (reference[e] > 0 && err / reference[e] > maxrel)
+                maxrel = err / reference[e];
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "distance %s", list[k].name);
+        printf("%-24s %12.2f %14.3e %14.3e\n", name, seconds * 1e9 / ((double)nedges * repeats), maxabs, maxrel);
+    }
+
+    // Heuristic towards a fixed target for every successor of every node
+    double tlat = nodes[target].lat, tlon = nodes[target].lon;
+    start_time = clock();
+    for (int r = 0; r < repeats; r++)
+        for (unsigned long e = 0; e < nedges; e++)
+        {
+            unsigned long v = map->adj[e];
+            out[e] = sqrt((nodes[v].lat - tlat) * (nodes[v].lat - tlat) + (nodes[v].lon - tlon) * (nodes[v].lon - tlon));
+        }
+    seconds = (double)(clock() - start_time) / CLOCKS_PER_SEC;
+    checksum += out[nedges / 2];
+    printf("%-24s %12.2f %14s %14s\n", "heuristic sqrt (old)", seconds * 1e9 / ((double)nedges * repeats), "-", "-");
+
+    for (unsigned long e = 0; e < nedges; e++)
+        reference[e] = haversine(nodes[map->adj[e]].lat, nodes[map->adj[e]].lon, tlat, tlon);
+    for (int k = 0; k < nkernels; k++)
+    {
+        double maxabs = 0, maxrel = 0;
+        start_time = clock();
+        for (int r = 0; r < repeats; r++)
+            for (unsigned long i = 0; i < map->nnodes; i++)
+                list[k].heuristic(map->x, map->y, map->z, map->adj + map->first[i], map->first[i + 1] - map->first[i],
+                                  map->x[target], map->y[target], map->z[target], out + map->first[i]);
+        seconds = (double)(clock() - start_time) / CLOCKS_PER_SEC;
+        for (unsigned long e = 0; e < nedges; e++)
+        {
+            double err = fabs(out[e] - reference[e]);
+            if (err > maxabs)
+                maxabs = err;
+            if (reference[e] > 0 && err / reference[e] > maxrel)
+                maxrel = err / reference[e];
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "heuristic %s", list[k].name);
+        printf("%-24s %12.2f %14.3e %14.3e\n", name, seconds * 1e9 / ((double)nedges * repeats), maxabs, maxrel);
+    }
+
+    printf("Checksum of the old heuristic: %f\n", checksum); // Keeps its loop from being optimized away
+    free(from);
+    free(reference);
+    free(out);
+}
+
+// Node index for an id or a name. A name with no exact match is taken as a
+// prefix. When several nodes match they are all listed and, as for an unknown
+// id, nnodes + 1 is returned.
+unsigned long findNode(graph *map, const char *arg, int verbose)
+{
+    char *ptr;
+    unsigned long id = strtoul(arg, &ptr, 10);
+    if (*arg != '\0' && *ptr == '\0')
+        return searchNode(id, map->nodes, map->nnodes);
+
+    unsigned long lo, hi;
+    double start = wallClock();
+    int exact = findNames(map, arg, &lo, &hi);
+    double elapsed = wallClock() - start;
+    if (verbose)
+        printf("Name lookup of \"%s\": %lu %s matches in %.1f microseconds\n", arg, hi - lo, exact ? "exact" : "prefix", elapsed * 1e6);
+    if (hi - lo == 1)
+        return map->names[lo].node;
+    if (!verbose)
+    {
+        if (hi - lo > 1)
+            printf("The name \"%s\" is ambiguous (%lu matches)\n", arg, hi - lo);
+        return map->nnodes + 1;
+    }
+    for (unsigned long i = lo; i < hi; i++)
+    {
+        node *n = &map->nodes[map->names[i].node];
+        printf("Id = %lu | %s | %lf | %lf\n", n->id, map->namearena + map->names[i].offset, n->lat, n->lon);
+    }
+    if (hi - lo > 1)
+        printf("The name \"%s\" is ambiguous, give one of the ids above\n", arg);
+    return map->nnodes + 1;
+}
+
+// Splits a line of a query file into at most max fields, separated by | when
+// the line has one, so names with spaces can be used, and by blanks otherwise.
+// Returns the number of fields.
+int splitQuery(char *line, char **fields, int max)
+{
+    const char *separators = strchr(line, '|') != NULL ? "|\r\n" : " \t\r\n";
+    int n = 0;
+    for (char *field = strtok(line, separators); field != NULL && n < max; field = strtok(NULL, separators))
+    {
+        while (*field == ' ' || *field == '\t')
+            field++;
+        size_t len = strlen(field);
+        while (len > 0 && (field[len - 1] == ' ' || field[len - 1] == '\t'))
+            field[--len] = '\0';
+        if (len > 0)
+            fields[n++] = field;
+    }
+    return n;
+}
+
+// Range [lo, hi) of the name index with the given name, ignoring case, or if
+// there is none with the names that start with it. Returns 1 for exact matches.
+int findNames(graph *map, const char *name, unsigned long *lo, unsigned long *hi)
+{
+    size_t len = strlen(name);
+    unsigned long l = 0, r = map->nnames;
+    while (l < r) // First entry not below name
+    {
+        unsigned long m = l + (r - l) / 2;
+        if (strcasecmp(map->namearena + map->names[m].offset, name) < 0)
+            l = m + 1;
+        else
+            r = m;
+    }
+    *lo = l;
+
+    r = map->nnames;
+    while (l < r) // First entry above name
+    {
+        unsigned long m = l + (r - l) / 2;
+        if (strcasecmp(map->namearena + map->names[m].offset, name) <= 0)
+            l = m + 1;
+        else
+            r = m;
+    }
+    if (l > *lo)
+    {
+        *hi = l;
+        return 1;
+    }
+
+    r = map->nnames;
+    while (l < r) // First entry that does not start with name
+    {
+        unsigned long m = l + (r - l) / 2;
+        if (strncasecmp(map->namearena + map->names[m].offset, name, len) <= 0)
+            l = m + 1;
+        else
+            r = m;
+    }
+    *hi = l;
+    return 0;
 }
 
 unsigned long searchNode(unsigned long id, node *nodes, unsigned long nnodes)
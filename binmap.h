@@ -0,0 +1,292 @@
+// binmap.h
+// Reader of the .bin files written by createbin.c, shared by binastar.c and
+// createcrp.c so a change of the file layout is made in one place. The graph
+// is kept as CSR arrays, one set per routing profile, and the arrays can be
+// backed by huge pages (see numaplace.h, which needs _GNU_SOURCE defined by
+// the file that includes this one).
+#ifndef BINMAP_H
+#define BINMAP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "geokernels.h"
+#include "numaplace.h"
+
+typedef struct
+{
+    unsigned long id; // Node identification
+    char *name;
+    double lat, lon;      // Node position
+    unsigned short nsucc; // Number of node successors; i. e. length of successors
+    unsigned long *successors;
+    int g;
+    double h;
+    double f;
+    int index;
+    int parent_index;
+} node;
+
+#define PROFILE_MAX 8
+
+// Header of a PROF section of the .bin, see createbin.c
+typedef struct
+{
+    char name[8];
+    char unit[8];  // "m" or "s"
+    double hscale; // Great-circle meters to a lower bound of the weight
+    unsigned long nedges;
+} profileheader;
+
+typedef struct
+{
+    profileheader header;
+    unsigned long *first, *adj;
+    double *weight;
+} profile;
+
+// Entry of the NAME section: the nodes sorted by name ignoring case
+typedef struct
+{
+    unsigned long offset; // Of the name in the arena
+    unsigned long node;
+} nameentry;
+
+typedef struct
+{
+    unsigned long nnodes, nedges;
+    node *nodes;
+    double *x, *y, *z;    // Unit vectors of the nodes (SoA), read by the geodesic kernels
+    unsigned long *first; // The successors of node i are adj[first[i]] ... adj[first[i + 1] - 1]
+    unsigned long *adj;
+    double *weight;         // Weight of every edge in adj, in the unit of the profile
+    unsigned short maxsucc; // Largest number of successors of a node, in any profile
+    profile profiles[PROFILE_MAX]; // Profile 0 is the whole network weighted by length
+    int nprofiles, current;
+    double hscale; // Of the current profile: first, adj and weight point to its arrays
+    int huge;      // Page size backing the arrays, PLACE_MALLOC, PLACE_THP or PLACE_HUGETLB
+    unsigned long nnames; // Name index, empty for maps written without one
+    nameentry *names;
+    char *namearena;
+} graph;
+
+// Switching profile only swaps the arrays the searches read
+static inline void useProfile(graph *map, int p)
+{
+    map->current = p;
+    map->first = map->profiles[p].first;
+    map->adj = map->profiles[p].adj;
+    map->weight = map->profiles[p].weight;
+    map->nedges = map->profiles[p].header.nedges;
+    map->hscale = map->profiles[p].header.hscale;
+}
+
+static inline int loadGraph(const char *binmapname, graph *map)
+{
+    FILE *binmapfile;
+    unsigned long nnodes;
+
+    binmapfile = fopen(binmapname, "rb");
+    if (binmapfile == NULL)
+    {
+        printf("Error when opening the file %s\n", binmapname);
+        return 1;
+    }
+    if (fread(&nnodes, sizeof(unsigned long), 1, binmapfile) != 1)
+    {
+        printf("Error when reading the file %s\n", binmapname);
+        return 1;
+    }
+
+    node *nodes;
+
+    nodes = (node *)placeAlloc(nnodes * sizeof(node), map->huge, -1);
+    map->first = (unsigned long *)placeAlloc((nnodes + 1) * sizeof(unsigned long), map->huge, -1);
+
+    if (nodes == NULL || map->first == NULL)
+    {
+        printf("Error when allocating the memory for the nodes\n");
+        return 2;
+    }
+    if (fread(nodes, sizeof(node), nnodes, binmapfile) != nnodes)
+    {
+        printf("Error when reading the nodes of %s\n", binmapname);
+        return 1;
+    }
+
+    // The successor lists are stored one after the other, so we read them all at once
+    map->maxsucc = 0;
+    map->first[0] = 0;
+    for (unsigned long i = 0; i < nnodes; ++i)
+    {
+        map->first[i + 1] = map->first[i] + nodes[i].nsucc;
+        if (nodes[i].nsucc > map->maxsucc)
+            map->maxsucc = nodes[i].nsucc;
+    }
+    map->nedges = map->first[nnodes];
+    map->adj = (unsigned long *)placeAlloc((map->nedges + 1) * sizeof(unsigned long), map->huge, -1);
+    if (map->adj == NULL)
+    {
+        printf("Error when allocating the memory for the edges\n");
+        return 2;
+    }
+    if (fread(map->adj, sizeof(unsigned long), map->nedges, binmapfile) != map->nedges)
+    {
+        printf("Error when reading the edges of %s\n", binmapname);
+        return 1;
+    }
+    for (unsigned long i = 0; i < nnodes; ++i)
+        nodes[i].successors = map->adj + map->first[i];
+
+    // Optional sections
+    char tag[4];
+    unsigned long size;
+    map->weight = NULL;
+    map->nprofiles = 1; // The first one is filled in below
+    map->nnames = 0;
+    map->names = NULL;
+    map->namearena = NULL;
+    while (fread(tag, 1, 4, binmapfile) == 4 && fread(&size, sizeof(unsigned long), 1, binmapfile) == 1)
+    {
+        if (strncmp(tag, "DIST", 4) == 0 && size == map->nedges * sizeof(double))
+        {
+            map->weight = (double *)placeAlloc(size + sizeof(double), map->huge, -1);
+            if (map->weight == NULL || fread(map->weight, 1, size, binmapfile) != size)
+            {
+                printf("Error when reading the edge lengths of %s\n", binmapname);
+                return 1;
+            }
+        }
+        else if (strncmp(tag, "PROF", 4) == 0 && size >= sizeof(profileheader) && map->nprofiles < PROFILE_MAX)
+        {
+            profile *p = &map->profiles[map->nprofiles];
+            if (fread(&p->header, sizeof(profileheader), 1, binmapfile) != 1)
+            {
+                printf("Error when reading a profile of %s\n", binmapname);
+                return 1;
+            }
+            unsigned long n = p->header.nedges;
+            if (size != sizeof(profileheader) + (nnodes + 1 + n) * sizeof(unsigned long) + n * sizeof(double))
+            {
+                fseek(binmapfile, size - sizeof(profileheader), SEEK_CUR);
+                continue;
+            }
+            p->header.name[sizeof(p->header.name) - 1] = '\0';
+            p->first = (unsigned long *)placeAlloc((nnodes + 1) * sizeof(unsigned long), map->huge, -1);
+            p->adj = (unsigned long *)placeAlloc((n + 1) * sizeof(unsigned long), map->huge, -1);
+            p->weight = (double *)placeAlloc((n + 1) * sizeof(double), map->huge, -1);
+            if (p->first == NULL || p->adj == NULL || p->weight == NULL)
+            {
+                printf("Error when allocating the memory for the profile %s\n", p->header.name);
+                return 2;
+            }
+            if (fread(p->first, sizeof(unsigned long), nnodes + 1, binmapfile) != nnodes + 1 ||
+                fread(p->adj, sizeof(unsigned long), n, binmapfile) != n ||
+                fread(p->weight, sizeof(double), n, binmapfile) != n)
+            {
+                printf("Error when reading the profile %s of %s\n", p->header.name, binmapname);
+                return 1;
+            }
+            for (unsigned long i = 0; i < nnodes; i++)
+                if (p->first[i + 1] - p->first[i] > map->maxsucc)
+                    map->maxsucc = p->first[i + 1] - p->first[i];
+            map->nprofiles++;
+        }
+        else if (strncmp(tag, "NAME", 4) == 0 && size >= 2 * sizeof(unsigned long))
+        {
+            unsigned long header[2]; // Entries and arena size
+            if (fread(header, sizeof(unsigned long), 2, binmapfile) != 2 ||
+                size != 2 * sizeof(unsigned long) + header[0] * sizeof(nameentry) + header[1])
+            {
+                printf("Error when reading the name index of %s\n", binmapname);
+                return 1;
+            }
+            map->names = (nameentry *)malloc((header[0] + 1) * sizeof(nameentry));
+            map->namearena = (char *)malloc(header[1] + 1);
+            if (map->names == NULL || map->namearena == NULL ||
+                fread(map->names, sizeof(nameentry), header[0], binmapfile) != header[0] ||
+                fread(map->namearena, 1, header[1], binmapfile) != header[1])
+            {
+                printf("Error when reading the name index of %s\n", binmapname);
+                return 1;
+            }
+            map->namearena[header[1]] = '\0';
+            map->nnames = header[0];
+        }
+        else
+            fseek(binmapfile, size, SEEK_CUR);
+    }
+
+    fclose(binmapfile);
+
+    map->nnodes = nnodes;
+    map->nodes = nodes;
+    map->x = (double *)placeAlloc(nnodes * sizeof(double), map->huge, -1);
+    map->y = (double *)placeAlloc(nnodes * sizeof(double), map->huge, -1);
+    map->z = (double *)placeAlloc(nnodes * sizeof(double), map->huge, -1);
+    if (map->x == NULL || map->y == NULL || map->z == NULL)
+    {
+        printf("Error when allocating the memory for the coordinates\n");
+        return 2;
+    }
+    for (unsigned long i = 0; i < nnodes; ++i)
+        geo_unitvector(nodes[i].lat, nodes[i].lon, &map->x[i], &map->y[i], &map->z[i]);
+
+    if (map->weight == NULL)
+    {
+        // Files written before the DIST section existed: compute the lengths here
+        unsigned long *from = (unsigned long *)malloc((map->nedges + 1) * sizeof(unsigned long));
+        map->weight = (double *)placeAlloc((map->nedges + 1) * sizeof(double), map->huge, -1);
+        if (from == NULL || map->weight == NULL)
+        {
+            printf("Error when allocating the memory for the edge lengths\n");
+            return 2;
+        }
+        for (unsigned long i = 0; i < nnodes; ++i)
+            for (unsigned long e = map->first[i]; e < map->first[i + 1]; e++)
+                from[e] = i;
+        geo_distance(map->x, map->y, map->z, from, map->adj, map->nedges, map->weight);
+        free(from);
+    }
+
+    profile *base = &map->profiles[0];
+    memset(&base->header, 0, sizeof(profileheader));
+    strcpy(base->header.name, "dist");
+    strcpy(base->header.unit, "m");
+    base->header.hscale = 1;
+    base->header.nedges = map->nedges;
+    base->first = map->first;
+    base->adj = map->adj;
+    base->weight = map->weight;
+    useProfile(map, 0);
+
+    return 0;
+}
+
+static inline int findProfile(graph *map, const char *name)
+{
+    for (int p = 0; p < map->nprofiles; p++)
+        if (strcmp(map->profiles[p].header.name, name) == 0)
+            return p;
+    return -1;
+}
+
+static inline void freeGraph(graph *map)
+{
+    placeFree(map->nodes, map->nnodes * sizeof(node), map->huge, -1);
+    for (int p = 0; p < map->nprofiles; p++)
+    {
+        unsigned long n = map->profiles[p].header.nedges;
+        placeFree(map->profiles[p].first, (map->nnodes + 1) * sizeof(unsigned long), map->huge, -1);
+        placeFree(map->profiles[p].adj, (n + 1) * sizeof(unsigned long), map->huge, -1);
+        placeFree(map->profiles[p].weight, (n + 1) * sizeof(double), map->huge, -1);
+    }
+    placeFree(map->x, map->nnodes * sizeof(double), map->huge, -1);
+    placeFree(map->y, map->nnodes * sizeof(double), map->huge, -1);
+    placeFree(map->z, map->nnodes * sizeof(double), map->huge, -1);
+    free(map->names);
+    free(map->namearena);
+}
+
+#endif
@@ -0,0 +1,114 @@
+#!/bin/bash
+# Regression check: builds the programs, makes a synthetic map and compares
+# the fast paths against the plain ones. Exits with 1 on the first mismatch.
+#   ./check.sh [size]   (a size x size grid, 40 by default)
+
+size=${1:-40}
+src=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cd "$work" || exit 1
+
+fail()
+{
+    echo "FAIL: $1"
+    exit 1
+}
+
+echo "Building in $work"
+gcc -O2 -Wall -pthread "$src/binastar.c" -o binastar -lm || fail "binastar does not build"
+gcc -O2 -Wall -pthread "$src/createcrp.c" -o createcrp -lm || fail "createcrp does not build"
+gcc -O2 "$src/createbin.c" -o createbin -lm || fail "createbin does not build"
+
+# A grid with every road class, oneways, maxspeeds in km/h and mph, a few
+# names and a node at the same place as its neighbour (zero length edges)
+awk -v n="$size" 'BEGIN {
+    print "# node|@id|@name|place|highway|route|ref|oneway|maxspeed|node_lat|node_lon"
+    for (r = 0; r < n; r++)
+        for (c = 0; c < n; c++)
+        {
+            id = 1000 + 3 * (r * n + c)
+            name = (r * n + c) % 97 == 0 ? "Plaza " r "-" c : ""
+            printf "node|%d|%s||||||||%.7f|%.7f\n", id, name, 42.5 + r * 0.001 + (c % 3) * 0.0001, 1.5 + c * 0.0013 + (r % 5) * 0.0001
+        }
+    printf "node|%d|||||||||%.7f|%.7f\n", 1000 + 3 * n * n, 42.5, 1.5
+    split("residential primary footway cycleway motorway track service steps", class, " ")
+    for (r = 0; r < n; r++)
+    {
+        oneway = r % 4 == 1 ? "yes" : (r % 4 == 3 ? "-1" : "")
+        maxspeed = r % 3 == 0 ? "50" : (r % 3 == 1 ? "30 mph" : "")
+        printf "way|%d|||%s|||%s|%s", r + 1, class[r % 8 + 1], oneway, maxspeed
+        if (r == 0)
+            printf "|%d", 1000 + 3 * n * n
+        for (c = 0; c < n; c++)
+            printf "|%d", 1000 + 3 * (r * n + c)
+        printf "\n"
+    }
+    for (c = 0; c < n; c++)
+    {
+        printf "way|%d|||%s|||||", n + c + 1, c % 2 ? "residential" : "secondary"
+        for (r = 0; r < n; r++)
+            printf "|%d", 1000 + 3 * (r * n + c)
+        printf "\n"
+    }
+}' > grid.csv
+# Same map with the node lines shuffled, for the streaming build
+(grep -v '^way' grid.csv | shuf --random-source=<(yes); grep '^way' grid.csv) > shuffled.csv
+
+origin=1000
+target=$((1000 + 3 * (size * size - 1)))
+middle=$((1000 + 3 * (size * size / 2 + size / 3)))
+
+# user-037: the streaming build of the shuffled map is byte for byte the
+# in-memory build of the sorted one (the scalar kernel rounds the same way)
+GEO_KERNEL=scalar ./createbin grid.csv > createbin.log || fail "createbin failed"
+GEO_KERNEL=scalar ./createbin shuffled.csv --stream --memory 1 --tmpdir . > stream.log || fail "createbin --stream failed"
+cmp grid.csv.bin shuffled.csv.bin || fail "the streaming build differs from the in-memory build"
+echo "ok streaming build"
+
+# user-028: delta-stepping against serial Dijkstra, also from the zero length edge
+for o in $origin $middle $((1000 + 3 * size * size)); do
+    ./binastar grid.csv.bin --sssp $o --threads 3 --verify > sssp.log || fail "--sssp $o failed"
+    grep -q "identical to serial Dijkstra: yes" sssp.log || fail "--sssp $o differs from Dijkstra"
+done
+for p in car foot; do
+    ./binastar grid.csv.bin --profile $p --sssp $middle --threads 3 --verify > sssp.log || fail "--sssp with $p failed"
+    grep -q "identical to serial Dijkstra: yes" sssp.log || fail "--sssp with $p differs from Dijkstra"
+done
+echo "ok sssp"
+
+# user-029: CRP against A*, on the plain network and on a profile
+pathline()
+{
+    rm -f finalpath.txt
+    ./binastar "$@" > query.log && [ -f finalpath.txt ] || return
+    head -1 finalpath.txt | awk '{ for (i = 1; i < NF; i++) {
+        if ($(i + 1) ~ /^meters/) printf "%s ", $i
+        if ($i == "cost") printf "%s ", $(i + 1) } }'
+}
+same()
+{
+    awk -v a="$1" -v b="$2" 'BEGIN { split(a, x, " "); split(b, y, " ");
+        if (length(x) == 0 || length(x) != length(y)) exit 1;
+        for (i in x) { d = x[i] - y[i]; if (d < 0) d = -d; if (d > 1e-6 * (x[i] < 0 ? -x[i] : x[i]) + 1e-9) exit 1 } }'
+}
+./createcrp grid.csv.bin --cellsize 64 > crp.log || fail "createcrp failed"
+./createcrp grid.csv.bin --profile car --cellsize 64 > crp.log || fail "createcrp --profile car failed"
+for pair in "$origin $target" "$target $origin" "$middle $origin"; do
+    astar=$(pathline grid.csv.bin $pair)
+    crp=$(pathline grid.csv.bin --crp $pair)
+    same "$astar" "$crp" || fail "CRP $pair: $crp, A*: $astar"
+    astar=$(pathline grid.csv.bin --profile car $pair)
+    crp=$(pathline grid.csv.bin --profile car --crp $pair)
+    same "$astar" "$crp" || fail "CRP car $pair: $crp, A*: $astar"
+done
+echo "ok crp"
+
+# user-036: every width of the batch engine returns the costs of width 1
+./binastar grid.csv.bin --batch 200 --width 8 --threads 2 > batch.log || fail "--batch failed"
+grep -q "NO" batch.log && fail "a batch width differs from width 1"
+./binastar grid.csv.bin --profile bike --batch 200 --width 4 > batch.log || fail "--batch with bike failed"
+grep -q "NO" batch.log && fail "a batch width with bike differs from width 1"
+echo "ok batch"
+
+echo "All checks passed"
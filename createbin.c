@@ -1,8 +1,31 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <math.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "geokernels.h"
+
+// Layout of the .bin file:
+// - nnodes, followed by the nnodes node structs (pointers inside are meaningless)
+// - the successors of every node, in node order
+// - optional sections, each one a 4 character tag, its size in bytes as an
+//   unsigned long and then the data. Readers skip the tags they do not know.
+//   DIST: length in meters of every edge, as doubles in successor order
+//   PROF: one routing profile (car, bike, foot) with its own edge set. A
+//         profileheader, then first[nnodes + 1], adj[nedges] and
+//         weight[nedges] as in a CSR graph. hscale turns a great-circle
+//         distance in meters into a lower bound of the weight.
+//   NAME: index of the node names. The number of entries and the arena size,
+//         then the entries (offset of the name in the arena, node index)
+//         sorted by name ignoring case, then the arena of NUL terminated
+//         names, each distinct name stored once.
+//
+// createbin map.csv --stream [--memory MB] builds the same file without
+// holding the map in memory, see streamBuild().
 
 typedef struct
 {
@@ -18,7 +41,214 @@ typedef struct
     int parent_index;
 } node;
 
+#define ACCESS_CAR 1
+#define ACCESS_BIKE 2
+#define ACCESS_FOOT 4
+
+// Who may use a highway class and how fast a car goes on it when the way has
+// no maxspeed. There is no access column in the CSV, so it follows the class.
+typedef struct
+{
+    const char *highway;
+    double speed; // km/h
+    int access;
+} roadclass;
+
+static const roadclass roadclasses[] = {
+    {"motorway", 120, ACCESS_CAR},
+    {"motorway_link", 60, ACCESS_CAR},
+    {"trunk", 90, ACCESS_CAR},
+    {"trunk_link", 50, ACCESS_CAR},
+    {"primary", 70, ACCESS_CAR | ACCESS_BIKE | ACCESS_FOOT},
+    {"primary_link", 50, ACCESS_CAR | ACCESS_BIKE | ACCESS_FOOT},
+    {"secondary", 60, ACCESS_CAR | ACCESS_BIKE | ACCESS_FOOT},
+    {"secondary_link", 50, ACCESS_CAR | ACCESS_BIKE | ACCESS_FOOT},
+    {"tertiary", 50, ACCESS_CAR | ACCESS_BIKE | ACCESS_FOOT},
+    {"tertiary_link", 40, ACCESS_CAR | ACCESS_BIKE | ACCESS_FOOT},
+    {"unclassified", 40, ACCESS_CAR | ACCESS_BIKE | ACCESS_FOOT},
+    {"road", 30, ACCESS_CAR | ACCESS_BIKE | ACCESS_FOOT},
+    {"residential", 30, ACCESS_CAR | ACCESS_BIKE | ACCESS_FOOT},
+    {"service", 20, ACCESS_CAR | ACCESS_BIKE | ACCESS_FOOT},
+    {"living_street", 10, ACCESS_CAR | ACCESS_BIKE | ACCESS_FOOT},
+    {"track", 0, ACCESS_BIKE | ACCESS_FOOT},
+    {"cycleway", 0, ACCESS_BIKE | ACCESS_FOOT},
+    {"path", 0, ACCESS_BIKE | ACCESS_FOOT},
+    {"footway", 0, ACCESS_FOOT},
+    {"pedestrian", 0, ACCESS_FOOT},
+    {"steps", 0, ACCESS_FOOT},
+    {"bridleway", 0, ACCESS_FOOT},
+};
+
+#define NPROFILES 3
+
+typedef struct
+{
+    char name[8];
+    char unit[8]; // "m" or "s"
+    double hscale;
+    unsigned long nedges;
+} profileheader;
+
+typedef struct
+{
+    unsigned long from, to;
+    double speed; // m/s, only used by the car profile
+} profileedge;
+
+typedef struct
+{
+    profileedge *items;
+    unsigned long size, capacity;
+} edgelist;
+
+typedef struct
+{
+    unsigned long offset, node;
+} nameentry;
+
+typedef struct
+{
+    const char *name;
+    unsigned long node;
+} namedsort;
+
+// Records of the streaming build. Each one goes through an external sort.
+typedef struct
+{
+    unsigned long id, seq; // seq is the position of the line in the CSV
+    double lat, lon;
+    char name[];
+} noderecord;
+
+typedef struct
+{
+    unsigned long id, seq; // seq numbers the node references of all the ways
+} refrecord;
+
+typedef struct
+{
+    unsigned long seq, index; // index is nnodes + 1 for a node that is not in the map
+    double x, y, z;
+} resolvedrecord;
+
+typedef struct
+{
+    int class; // In roadclasses, -1 for none
+    int oneway;
+    double maxspeed;
+    unsigned long nrefs;
+} wayrecord;
+
+typedef struct
+{
+    unsigned long id;
+    double lat, lon;
+} nodeposition;
+
+typedef struct
+{
+    unsigned long from, seq, to; // seq keeps the order in which the edges were found
+    double length;
+} baserecord;
+
+typedef struct
+{
+    unsigned long profile, from, to;
+    double speed, length;
+} profilerecord;
+
+typedef struct
+{
+    unsigned long node;
+    char name[];
+} namerecord;
+
+#define PAIRBATCH 1024
+
+// Consecutive way nodes waiting for their distance, computed a batch at a time
+typedef struct
+{
+    double x[2 * PAIRBATCH], y[2 * PAIRBATCH], z[2 * PAIRBATCH];
+    unsigned long from[PAIRBATCH], to[PAIRBATCH];
+    double length[PAIRBATCH];
+    unsigned long origin[PAIRBATCH], dest[PAIRBATCH];
+    int class[PAIRBATCH], oneway[PAIRBATCH];
+    double maxspeed[PAIRBATCH];
+    unsigned long n;
+} pairbatch;
+
+#define RUN_MINREAD (64UL << 10) // Smallest read buffer of a run in a merge
+#define RUN_MAXFANIN 128UL
+
+typedef struct
+{
+    unsigned long start, end; // Bytes of the run in the spill file
+} sortrun;
+
+typedef struct
+{
+    int fd;
+    unsigned long pos, end; // Part of the run still on disk
+    char *buf;
+    unsigned long bufsize, at, filled;
+    char *record; // Current record
+    unsigned long len, capacity;
+} runreader;
+
+// External sort of variable sized records in a fixed budget. Records fill the
+// buffer from the front and their offsets from the back. A full buffer is
+// sorted and spilled as a run to a temporary file, and the runs are merged,
+// in several passes if there are more of them than the budget can read at once.
+typedef struct
+{
+    int (*compare)(const void *, const void *);
+    const char *tmpdir;
+    unsigned long budget;
+    char *buffer;
+    unsigned long used, nrecords, next, count;
+    FILE *spill;
+    sortrun *runs;
+    unsigned long nruns, maxruns, spilled;
+    runreader *readers;
+    unsigned long *heap, nheap, last;
+} extsort;
+
 unsigned long searchNode(unsigned long id, node *nodes, unsigned long nnodes);
+char *parseWay(char *tmpline, const roadclass **class, int *oneway, double *maxspeed);
+void writeSection(FILE *binmapfile, const char *tag, const void *data, unsigned long size);
+const roadclass *findRoadClass(const char *highway);
+int parseOneway(const char *value);
+double parseMaxspeed(const char *value);
+void addProfileEdge(edgelist *l, unsigned long from, unsigned long to, double speed, int oneway);
+int compareProfileEdges(const void *a, const void *b);
+void writeProfile(FILE *binmapfile, const char *name, edgelist *l, unsigned long nnodes, double *x, double *y, double *z);
+int compareNames(const void *a, const void *b);
+void writeNameIndex(FILE *binmapfile, node *nodes, unsigned long nnodes);
+void printPeakMemory(void);
+int streamBuild(const char *mapname, unsigned long budget, const char *tmpdir);
+void queuePair(pairbatch *batch, const resolvedrecord *origin, const resolvedrecord *dest, const wayrecord *w, extsort *basesort, extsort *profsort, unsigned long *nbase);
+void flushPairs(pairbatch *batch, extsort *basesort, extsort *profsort, unsigned long *nbase);
+const profilerecord *streamProfile(FILE *binmapfile, const char *name, unsigned long p, extsort *profsort, const profilerecord *e, unsigned long nnodes, const char *tmpdir);
+void streamNames(FILE *binmapfile, extsort *namesort, const char *tmpdir);
+int compareNodeRecords(const void *a, const void *b);
+int compareRefRecords(const void *a, const void *b);
+int compareResolvedRecords(const void *a, const void *b);
+int compareBaseRecords(const void *a, const void *b);
+int compareProfileRecords(const void *a, const void *b);
+int compareNameRecords(const void *a, const void *b);
+FILE *tempFile(const char *tmpdir);
+void copyFile(FILE *from, FILE *to);
+void *scratch(unsigned long size);
+void extsortInit(extsort *s, int (*compare)(const void *, const void *), unsigned long budget, const char *tmpdir);
+void extsortAdd(extsort *s, const void *record, unsigned long len);
+void extsortSpill(extsort *s);
+void extsortFinish(extsort *s);
+const void *extsortNext(extsort *s, unsigned long *len);
+void extsortFree(extsort *s);
+void mergeOpen(extsort *s, unsigned long first, unsigned long count, unsigned long budget);
+const void *mergeNext(extsort *s, unsigned long *len);
+void mergeClose(extsort *s, unsigned long count);
+int readerNext(runreader *r);
 
 int main(int argc, char *argv[])
 {
@@ -36,6 +266,33 @@ int main(int argc, char *argv[])
     if (argc > 1)
         strcpy(mapname, argv[1]);
 
+    int stream = 0;
+    unsigned long budget = 256; // MB
+    const char *tmpdir = ".";
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--stream") == 0)
+            stream = 1;
+        else if (strcmp(argv[i], "--memory") == 0 && i + 1 < argc)
+        {
+            budget = strtoul(argv[++i], NULL, 10);
+            stream = 1;
+        }
+        else if (strcmp(argv[i], "--tmpdir") == 0 && i + 1 < argc)
+            tmpdir = argv[++i];
+        else
+        {
+            printf("Usage: %s map.csv [--stream] [--memory MB] [--tmpdir dir]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (stream)
+    {
+        if (budget < 1)
+            budget = 1;
+        return streamBuild(mapname, budget << 20, tmpdir);
+    }
+
     mapfile = fopen(mapname, "r");
     if (mapfile == NULL)
     {
@@ -61,6 +318,7 @@ int main(int argc, char *argv[])
     node *nodes;
     char *tmpline, *field, *ptr;
     unsigned long index = 0;
+    int unsorted = 0;
 
     nodes = (node *)malloc(nnodes * sizeof(node));
     if (nodes == NULL)
@@ -89,12 +347,17 @@ int main(int argc, char *argv[])
             nodes[index].lon = atof(field);
 
             nodes[index].nsucc = 0; // start with 0 successors
+            nodes[index].successors = NULL;
             nodes[index].index = index;
+            if (index > 0 && nodes[index].id < nodes[index - 1].id)
+                unsorted = 1;
 
             index++;
         }
     }
     printf("Assigned data to %ld nodes\n", index);
+    if (unsorted)
+        printf("The node lines are not sorted by id, ways will lose edges. Use --stream for unsorted maps\n");
     printf("Elapsed time: %f seconds\n", (float)(clock() - start_time) / CLOCKS_PER_SEC);
     printf("Last node has:\n id=%lu\n GPS=(%lf,%lf)\n Name=%s\n", nodes[index - 1].id, nodes[index - 1].lat, nodes[index - 1].lon, nodes[index - 1].name);
 
@@ -103,6 +366,8 @@ int main(int argc, char *argv[])
     start_time = clock();
     int oneway;
     unsigned long nedges = 0, origin, dest, originId, destId;
+    double maxspeed;
+    edgelist profiles[NPROFILES] = {{NULL, 0, 0}, {NULL, 0, 0}, {NULL, 0, 0}}; // car, bike, foot
     while (getline(&line, &len, mapfile) != -1)
     {
         if (strncmp(line, "#", 1) == 0)
@@ -111,15 +376,8 @@ int main(int argc, char *argv[])
         field = strsep(&tmpline, "|");
         if (strcmp(field, "way") == 0)
         {
-            for (int i = 0; i < 7; i++)
-                field = strsep(&tmpline, "|"); // skip 7 fields
-            if (strcmp(field, "") == 0)
-                oneway = 0; // no oneway
-            else if (strcmp(field, "oneway") == 0)
-                oneway = 1;
-            else
-                continue;                  // No correct information
-            field = strsep(&tmpline, "|"); // skip 1 field
+            const roadclass *class = NULL;
+            tmpline = parseWay(tmpline, &class, &oneway, &maxspeed);
             field = strsep(&tmpline, "|");
             if (field == NULL)
                 continue;
@@ -140,8 +398,24 @@ int main(int argc, char *argv[])
                 }
                 if (origin == dest)
                     continue;
+                if (class != NULL)
+                {
+                    // Every profile keeps its own edges; oneway 2 is a reversible road
+                    if ((class->access & ACCESS_CAR) && maxspeed > 0 && oneway != 2)
+                        addProfileEdge(&profiles[0], origin, dest, maxspeed / 3.6, oneway);
+                    if (class->access & ACCESS_BIKE)
+                        addProfileEdge(&profiles[1], origin, dest, 0, oneway == 2 ? 0 : oneway);
+                    if (class->access & ACCESS_FOOT)
+                        addProfileEdge(&profiles[2], origin, dest, 0, 0);
+                }
+                if (oneway == 2)
+                {
+                    originId = destId;
+                    origin = dest;
+                    continue;
+                }
                 // Check if the edge did appear in a previous way
-                int newdest = 1;
+                int newdest = oneway != -1;
                 for (int i = 0; i < nodes[origin].nsucc; i++)
                     if (nodes[origin].successors[i] == dest)
                     {
@@ -162,7 +436,7 @@ int main(int argc, char *argv[])
                     nodes[origin].nsucc++;
                     nedges++;
                 }
-                if (!oneway)
+                if (oneway != 1)
                 {
                     // Check if the edge did appear in a previous way
                     int newor = 1;
@@ -195,6 +469,38 @@ int main(int argc, char *argv[])
 
     fclose(mapfile);
     printf("Assigned %ld edges\n", nedges);
+    printf("Profile edges: car %ld, bike %ld, foot %ld\n", profiles[0].size, profiles[1].size, profiles[2].size);
+    printf("Elapsed time: %f seconds\n", (float)(clock() - start_time) / CLOCKS_PER_SEC);
+
+    // Edge lengths, computed in one batch with the geodesic kernels
+    start_time = clock();
+    const char *kernel = geo_init();
+    double *x, *y, *z, *edgelength;
+    unsigned long *edgefrom, *edgeto, e = 0;
+
+    x = (double *)malloc(nnodes * sizeof(double));
+    y = (double *)malloc(nnodes * sizeof(double));
+    z = (double *)malloc(nnodes * sizeof(double));
+    edgefrom = (unsigned long *)malloc(nedges * sizeof(unsigned long));
+    edgeto = (unsigned long *)malloc(nedges * sizeof(unsigned long));
+    edgelength = (double *)malloc(nedges * sizeof(double));
+    if (x == NULL || y == NULL || z == NULL || edgefrom == NULL || edgeto == NULL || edgelength == NULL)
+    {
+        printf("Error when allocating the memory for the edge lengths\n");
+        return 2;
+    }
+    for (unsigned long i = 0; i < nnodes; i++)
+    {
+        geo_unitvector(nodes[i].lat, nodes[i].lon, &x[i], &y[i], &z[i]);
+        for (int j = 0; j < nodes[i].nsucc; j++)
+        {
+            edgefrom[e] = i;
+            edgeto[e] = nodes[i].successors[j];
+            e++;
+        }
+    }
+    geo_distance(x, y, z, edgefrom, edgeto, nedges, edgelength);
+    printf("Computed the length of %ld edges (%s kernel)\n", nedges, kernel);
     printf("Elapsed time: %f seconds\n", (float)(clock() - start_time) / CLOCKS_PER_SEC);
 
     FILE *binmapfile;
@@ -204,7 +510,19 @@ int main(int argc, char *argv[])
 
     binmapfile = fopen(binmapname, "wb");
     fwrite(&nnodes, sizeof(unsigned long), 1, binmapfile);
-    fwrite(nodes, sizeof(node), nnodes, binmapfile);
+    // Only the fields the readers use are kept, so both builds give the same bytes
+    for (int i = 0; i < nnodes; i++)
+    {
+        node record;
+        memset(&record, 0, sizeof(record));
+        record.id = nodes[i].id;
+        record.lat = nodes[i].lat;
+        record.lon = nodes[i].lon;
+        record.nsucc = nodes[i].nsucc;
+        record.g = -1;
+        record.index = i;
+        fwrite(&record, sizeof(node), 1, binmapfile);
+    }
 
     for (int i = 0; i < nnodes; i++)
     {
@@ -213,8 +531,14 @@ int main(int argc, char *argv[])
             fwrite(nodes[i].successors, sizeof(unsigned long), nodes[i].nsucc, binmapfile);
         }
     }
+    writeSection(binmapfile, "DIST", edgelength, nedges * sizeof(double));
+    writeProfile(binmapfile, "car", &profiles[0], nnodes, x, y, z);
+    writeProfile(binmapfile, "bike", &profiles[1], nnodes, x, y, z);
+    writeProfile(binmapfile, "foot", &profiles[2], nnodes, x, y, z);
+    writeNameIndex(binmapfile, nodes, nnodes);
 
     fclose(binmapfile);
+    printPeakMemory();
 
     return 0;
 }
@@ -230,10 +554,1090 @@ unsigned long searchNode(unsigned long id, node *nodes, unsigned long nnodes)
             return m;
         if (nodes[m].id < id)
             l = m + 1;
+        else if (m == 0)
+            break; // r would wrap around
         else
             r = m - 1;
     }
 
     // id not found, we return nnodes+1
     return nnodes + 1;
-}
\ No newline at end of file
+}
+
+// Reads the tags of a way line, after its type. Returns the rest of the line,
+// the node ids, or NULL when the line is cut short.
+char *parseWay(char *tmpline, const roadclass **class, int *oneway, double *maxspeed)
+{
+    char *field = NULL, *highway;
+    for (int i = 0; i < 3; i++)
+        field = strsep(&tmpline, "|"); // skip id, name and place
+    if (field == NULL)
+        return NULL;
+    highway = strsep(&tmpline, "|");
+    for (int i = 0; i < 3; i++)
+        field = strsep(&tmpline, "|"); // skip route and ref, stop at oneway
+    if (field == NULL)
+        return NULL;
+    *oneway = parseOneway(field);
+    field = strsep(&tmpline, "|");
+    if (field == NULL)
+        return NULL;
+    *class = findRoadClass(highway);
+    *maxspeed = parseMaxspeed(field);
+    if (*maxspeed <= 0 && *class != NULL)
+        *maxspeed = (*class)->speed;
+    return tmpline;
+}
+
+void writeSection(FILE *binmapfile, const char *tag, const void *data, unsigned long size)
+{
+    fwrite(tag, 1, 4, binmapfile);
+    fwrite(&size, sizeof(unsigned long), 1, binmapfile);
+    fwrite(data, 1, size, binmapfile);
+}
+
+const roadclass *findRoadClass(const char *highway)
+{
+    for (unsigned long i = 0; i < sizeof(roadclasses) / sizeof(roadclasses[0]); i++)
+        if (strcmp(highway, roadclasses[i].highway) == 0)
+            return &roadclasses[i];
+    return NULL; // Not a road, or not one we route on (construction, proposed...)
+}
+
+// 0 both directions, 1 only forward, -1 only backward, 2 reversible
+int parseOneway(const char *value)
+{
+    if (strcmp(value, "") == 0 || strcmp(value, "no") == 0)
+        return 0;
+    if (strcmp(value, "oneway") == 0 || strcmp(value, "yes") == 0 || strcmp(value, "true") == 0 || strcmp(value, "1") == 0)
+        return 1;
+    if (strcmp(value, "-1") == 0 || strcmp(value, "reverse") == 0)
+        return -1;
+    return 2;
+}
+
+// Speed limit in km/h, 0 when there is none or it is not a number ("none", "walk"...)
+double parseMaxspeed(const char *value)
+{
+    char *ptr;
+    double speed = strtod(value, &ptr);
+    if (ptr == value || speed <= 0)
+        return 0;
+    if (strstr(ptr, "mph") != NULL)
+        speed *= 1.609344;
+    return speed;
+}
+
+void addProfileEdge(edgelist *l, unsigned long from, unsigned long to, double speed, int oneway)
+{
+    if (l->size + 2 > l->capacity)
+    {
+        l->capacity = l->capacity ? 2 * l->capacity : 1024;
+        l->items = realloc(l->items, l->capacity * sizeof(profileedge));
+        if (l->items == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (oneway != -1)
+        l->items[l->size++] = (profileedge){from, to, speed};
+    if (oneway != 1)
+        l->items[l->size++] = (profileedge){to, from, speed};
+}
+
+int compareProfileEdges(const void *a, const void *b)
+{
+    const profileedge *ea = a, *eb = b;
+    if (ea->from != eb->from)
+        return ea->from < eb->from ? -1 : 1;
+    if (ea->to != eb->to)
+        return ea->to < eb->to ? -1 : 1;
+    return 0;
+}
+
+// Sorts the edges of a profile, keeps the cheapest of the duplicated ones and
+// writes them as a PROF section. The car weighs seconds, the others meters.
+void writeProfile(FILE *binmapfile, const char *name, edgelist *l, unsigned long nnodes, double *x, double *y, double *z)
+{
+    profileheader header;
+    int timed = strcmp(name, "car") == 0;
+    unsigned long *first = (unsigned long *)calloc(nnodes + 1, sizeof(unsigned long));
+    unsigned long *from = (unsigned long *)malloc((l->size + 1) * sizeof(unsigned long));
+    unsigned long *to = (unsigned long *)malloc((l->size + 1) * sizeof(unsigned long));
+    double *weight = (double *)malloc((l->size + 1) * sizeof(double));
+    if (first == NULL || from == NULL || to == NULL || weight == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    qsort(l->items, l->size, sizeof(profileedge), compareProfileEdges);
+    for (unsigned long e = 0; e < l->size; e++)
+    {
+        from[e] = l->items[e].from;
+        to[e] = l->items[e].to;
+    }
+    geo_distance(x, y, z, from, to, l->size, weight);
+
+    double vmax = 0;
+    unsigned long n = 0;
+    for (unsigned long e = 0; e < l->size; e++)
+    {
+        double w = weight[e];
+        if (timed)
+        {
+            w /= l->items[e].speed;
+            if (l->items[e].speed > vmax)
+                vmax = l->items[e].speed;
+        }
+        if (n > 0 && from[n - 1] == from[e] && to[n - 1] == to[e])
+        {
+            if (w < weight[n - 1])
+                weight[n - 1] = w;
+            continue;
+        }
+        from[n] = from[e];
+        to[n] = to[e];
+        weight[n++] = w;
+        first[from[e] + 1]++;
+    }
+    for (unsigned long i = 0; i < nnodes; i++)
+        first[i + 1] += first[i];
+
+    memset(&header, 0, sizeof(header));
+    strncpy(header.name, name, sizeof(header.name) - 1);
+    strcpy(header.unit, timed ? "s" : "m");
+    header.hscale = timed ? (vmax > 0 ? 1 / vmax : 0) : 1;
+    header.nedges = n;
+
+    unsigned long size = sizeof(header) + (nnodes + 1 + n) * sizeof(unsigned long) + n * sizeof(double);
+    fwrite("PROF", 1, 4, binmapfile);
+    fwrite(&size, sizeof(unsigned long), 1, binmapfile);
+    fwrite(&header, sizeof(header), 1, binmapfile);
+    fwrite(first, sizeof(unsigned long), nnodes + 1, binmapfile);
+    fwrite(to, sizeof(unsigned long), n, binmapfile);
+    fwrite(weight, sizeof(double), n, binmapfile);
+    printf("Profile %s: %ld edges, weights in %s\n", name, n, header.unit);
+
+    free(first);
+    free(from);
+    free(to);
+    free(weight);
+}
+
+int compareNames(const void *a, const void *b)
+{
+    const namedsort *na = a, *nb = b;
+    int c = strcasecmp(na->name, nb->name);
+    if (c == 0)
+        c = strcmp(na->name, nb->name);
+    if (c == 0)
+        c = (na->node > nb->node) - (na->node < nb->node);
+    return c;
+}
+
+// Sorted index of the named nodes, so binastar can take names as origin and
+// target and find them, or every name with a prefix, with a binary search
+void writeNameIndex(FILE *binmapfile, node *nodes, unsigned long nnodes)
+{
+    unsigned long nnamed = 0, arenasize = 0;
+    namedsort *sorted = (namedsort *)malloc((nnodes + 1) * sizeof(namedsort));
+    if (sorted == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (unsigned long i = 0; i < nnodes; i++)
+        if (nodes[i].name != NULL && nodes[i].name[0] != '\0')
+        {
+            sorted[nnamed].name = nodes[i].name;
+            sorted[nnamed++].node = i;
+            arenasize += strlen(nodes[i].name) + 1;
+        }
+    qsort(sorted, nnamed, sizeof(namedsort), compareNames);
+
+    nameentry *entries = (nameentry *)malloc((nnamed + 1) * sizeof(nameentry));
+    char *arena = (char *)malloc(arenasize + 1);
+    if (entries == NULL || arena == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    arenasize = 0;
+    for (unsigned long i = 0; i < nnamed; i++)
+    {
+        if (i == 0 || strcmp(sorted[i].name, sorted[i - 1].name) != 0)
+        {
+            entries[i].offset = arenasize;
+            strcpy(arena + arenasize, sorted[i].name);
+            arenasize += strlen(sorted[i].name) + 1;
+        }
+        else
+            entries[i].offset = entries[i - 1].offset; // Same name, stored once
+        entries[i].node = sorted[i].node;
+    }
+
+    unsigned long size = 2 * sizeof(unsigned long) + nnamed * sizeof(nameentry) + arenasize;
+    fwrite("NAME", 1, 4, binmapfile);
+    fwrite(&size, sizeof(unsigned long), 1, binmapfile);
+    fwrite(&nnamed, sizeof(unsigned long), 1, binmapfile);
+    fwrite(&arenasize, sizeof(unsigned long), 1, binmapfile);
+    fwrite(entries, sizeof(nameentry), nnamed, binmapfile);
+    fwrite(arena, 1, arenasize, binmapfile);
+    printf("Name index: %ld named nodes, %ld bytes of names\n", nnamed, arenasize);
+
+    free(sorted);
+    free(entries);
+    free(arena);
+}
+
+void printPeakMemory(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("Peak memory: %.1f MB\n", usage.ru_maxrss / 1024.0);
+}
+
+// Builds the same .bin as the in-memory path for maps that do not fit in
+// memory or whose node lines are not sorted by id. Nodes, way node references,
+// edges and names each go through an external sort that spills to tmpdir, the
+// references are resolved to node indices with a merge join against the
+// sorted nodes, and the file is written one section after the other. Apart
+// from a few small buffers only the sort buffers, budget bytes together, are
+// kept in memory. Nodes are numbered in id order, as in a sorted CSV.
+int streamBuild(const char *mapname, unsigned long budget, const char *tmpdir)
+{
+    clock_t start_time;
+    FILE *mapfile;
+    char *line = NULL, *tmpline, *field, *ptr;
+    size_t len;
+    unsigned long part = budget / 4; // At most four sorts are alive at a time
+    unsigned long nnodes = 0, nrefs = 0, nways = 0, reclen;
+
+    mapfile = fopen(mapname, "r");
+    if (mapfile == NULL)
+    {
+        printf("Error when opening the file\n");
+        return 1;
+    }
+    printf("Streaming build with %lu MB of sort buffers in %s\n", budget >> 20, tmpdir);
+
+    // Nodes and way node references to their sorts, way tags to a file
+    start_time = clock();
+    extsort nodesort, refsort;
+    extsortInit(&nodesort, compareNodeRecords, part, tmpdir);
+    extsortInit(&refsort, compareRefRecords, part, tmpdir);
+    FILE *wayfile = tempFile(tmpdir);
+    while (getline(&line, &len, mapfile) != -1)
+    {
+        if (strncmp(line, "#", 1) == 0)
+            continue;
+        tmpline = line;
+        field = strsep(&tmpline, "|");
+        if (strcmp(field, "node") == 0)
+        {
+            field = strsep(&tmpline, "|");
+            if (field == NULL)
+                continue;
+            unsigned long id = strtoul(field, &ptr, 10);
+            char *name = strsep(&tmpline, "|");
+            for (int i = 0; i < 7; i++)
+                field = strsep(&tmpline, "|");
+            char *lon = strsep(&tmpline, "|");
+            if (field == NULL || lon == NULL)
+                continue;
+            reclen = sizeof(noderecord) + strlen(name) + 1;
+            noderecord *n = scratch(reclen);
+            n->id = id;
+            n->seq = nnodes++;
+            n->lat = atof(field);
+            n->lon = atof(lon);
+            strcpy(n->name, name);
+            extsortAdd(&nodesort, n, reclen);
+        }
+        else if (strcmp(field, "way") == 0)
+        {
+            wayrecord w;
+            const roadclass *class = NULL;
+            tmpline = parseWay(tmpline, &class, &w.oneway, &w.maxspeed);
+            w.class = class != NULL ? (int)(class - roadclasses) : -1;
+            w.nrefs = 0;
+            while ((field = strsep(&tmpline, "|")) != NULL)
+            {
+                refrecord r = {strtoul(field, &ptr, 10), nrefs++};
+                extsortAdd(&refsort, &r, sizeof(r));
+                w.nrefs++;
+            }
+            if (w.nrefs == 0)
+                continue;
+            fwrite(&w, sizeof(w), 1, wayfile);
+            nways++;
+        }
+    }
+    fclose(mapfile);
+    free(line);
+    extsortFinish(&nodesort);
+    extsortFinish(&refsort);
+    printf("Read %lu nodes (%lu sorted runs) and %lu ways with %lu node references (%lu sorted runs)\n", nnodes, nodesort.spilled, nways, nrefs, refsort.spilled);
+    printf("Elapsed time: %f seconds\n", (float)(clock() - start_time) / CLOCKS_PER_SEC);
+
+    // Merge join of the references with the nodes, both sorted by id. Nodes
+    // are numbered in that order; the references to a repeated id go to its first node.
+    start_time = clock();
+    extsort namesort, resolvedsort;
+    extsortInit(&namesort, compareNameRecords, part, tmpdir);
+    extsortInit(&resolvedsort, compareResolvedRecords, part, tmpdir);
+    FILE *nodefile = tempFile(tmpdir);
+    unsigned long index = 0, resolved = 0;
+    resolvedrecord current = {0, nnodes + 1, 0, 0, 0}; // First node of the last id read
+    unsigned long currentid = 0;
+    const noderecord *n = extsortNext(&nodesort, NULL);
+    const refrecord *r;
+    while (1)
+    {
+        r = extsortNext(&refsort, NULL);
+        while (n != NULL && (r == NULL || n->id <= r->id))
+        {
+            nodeposition position = {n->id, n->lat, n->lon};
+            fwrite(&position, sizeof(position), 1, nodefile);
+            if (n->name[0] != '\0')
+            {
+                reclen = sizeof(namerecord) + strlen(n->name) + 1;
+                namerecord *named = scratch(reclen);
+                named->node = index;
+                strcpy(named->name, n->name);
+                extsortAdd(&namesort, named, reclen);
+            }
+            if (current.index == nnodes + 1 || n->id != currentid)
+            {
+                currentid = n->id;
+                current.index = index;
+                geo_unitvector(n->lat, n->lon, &current.x, &current.y, &current.z);
+            }
+            index++;
+            n = extsortNext(&nodesort, NULL);
+        }
+        if (r == NULL)
+            break;
+        resolvedrecord res = {r->seq, nnodes + 1, 0, 0, 0};
+        if (current.index != nnodes + 1 && currentid == r->id)
+        {
+            res = current;
+            res.seq = r->seq;
+            resolved++;
+        }
+        extsortAdd(&resolvedsort, &res, sizeof(res));
+    }
+    extsortFree(&nodesort);
+    extsortFree(&refsort);
+    extsortFinish(&resolvedsort);
+    printf("Resolved %lu of %lu node references\n", resolved, nrefs);
+    printf("Elapsed time: %f seconds\n", (float)(clock() - start_time) / CLOCKS_PER_SEC);
+
+    // Replay of the ways on the resolved references, in the CSV order, with
+    // the same rules as the in-memory build
+    start_time = clock();
+    const char *kernel = geo_init();
+    extsort basesort, profsort;
+    extsortInit(&basesort, compareBaseRecords, part, tmpdir);
+    extsortInit(&profsort, compareProfileRecords, part, tmpdir);
+    pairbatch *batch = (pairbatch *)malloc(sizeof(pairbatch));
+    if (batch == NULL)
+    {
+        printf("Error when allocating the memory for the edges\n");
+        return 2;
+    }
+    for (unsigned long i = 0; i < PAIRBATCH; i++)
+    {
+        batch->from[i] = 2 * i;
+        batch->to[i] = 2 * i + 1;
+    }
+    batch->n = 0;
+    unsigned long nbase = 0;
+    wayrecord w;
+    rewind(wayfile);
+    while (fread(&w, sizeof(w), 1, wayfile) == 1)
+    {
+        resolvedrecord origin = *(const resolvedrecord *)extsortNext(&resolvedsort, NULL), dest;
+        for (unsigned long i = 1; i < w.nrefs; i++)
+        {
+            dest = *(const resolvedrecord *)extsortNext(&resolvedsort, NULL);
+            if (origin.index == nnodes + 1 || dest.index == nnodes + 1)
+            {
+                origin = dest;
+                continue;
+            }
+            if (origin.index == dest.index)
+                continue;
+            if (w.class >= 0 || w.oneway != 2)
+                queuePair(batch, &origin, &dest, &w, &basesort, &profsort, &nbase);
+            origin = dest;
+        }
+    }
+    flushPairs(batch, &basesort, &profsort, &nbase);
+    free(batch);
+    fclose(wayfile);
+    extsortFree(&resolvedsort);
+    extsortFinish(&basesort);
+    extsortFinish(&profsort);
+    printf("Found %lu edges and %lu profile edges (%lu and %lu sorted runs, %s kernel)\n", nbase, profsort.count, basesort.spilled, profsort.spilled, kernel);
+    printf("Elapsed time: %f seconds\n", (float)(clock() - start_time) / CLOCKS_PER_SEC);
+
+    // Nodes and successors, grouped by origin in the order the edges were
+    // found, dropping the edges that already appeared in a previous way
+    start_time = clock();
+    FILE *binmapfile;
+    char binmapname[4096];
+    snprintf(binmapname, sizeof(binmapname), "%s.bin", mapname);
+    binmapfile = fopen(binmapname, "wb");
+    if (binmapfile == NULL)
+    {
+        printf("Error when opening %s\n", binmapname);
+        return 1;
+    }
+    FILE *succfile = tempFile(tmpdir), *distfile = tempFile(tmpdir);
+    unsigned long nedges = 0, *succ = NULL;
+    double *length = NULL;
+    unsigned long capacity = 0;
+    const baserecord *b = extsortNext(&basesort, NULL);
+    nodeposition position;
+    node record;
+    fwrite(&nnodes, sizeof(unsigned long), 1, binmapfile);
+    rewind(nodefile);
+    for (unsigned long i = 0; i < nnodes; i++)
+    {
+        if (fread(&position, sizeof(position), 1, nodefile) != 1)
+        {
+            printf("Error when reading back the nodes\n");
+            return 3;
+        }
+        unsigned long nsucc = 0;
+        for (; b != NULL && b->from == i; b = extsortNext(&basesort, NULL))
+        {
+            int newdest = 1;
+            for (unsigned long j = 0; j < nsucc; j++)
+                if (succ[j] == b->to)
+                {
+                    newdest = 0;
+                    break;
+                }
+            if (!newdest)
+                continue;
+            if (nsucc == capacity)
+            {
+                capacity = capacity ? 2 * capacity : 16;
+                succ = realloc(succ, capacity * sizeof(unsigned long));
+                length = realloc(length, capacity * sizeof(double));
+                if (succ == NULL || length == NULL)
+                {
+                    fprintf(stderr, "Memory allocation failed.\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            succ[nsucc] = b->to;
+            length[nsucc++] = b->length;
+        }
+        memset(&record, 0, sizeof(record));
+        record.id = position.id;
+        record.lat = position.lat;
+        record.lon = position.lon;
+        record.nsucc = nsucc;
+        record.g = -1;
+        record.index = i;
+        fwrite(&record, sizeof(node), 1, binmapfile);
+        fwrite(succ, sizeof(unsigned long), nsucc, succfile);
+        fwrite(length, sizeof(double), nsucc, distfile);
+        nedges += nsucc;
+    }
+    free(succ);
+    free(length);
+    fclose(nodefile);
+    extsortFree(&basesort);
+    copyFile(succfile, binmapfile);
+    unsigned long size = nedges * sizeof(double);
+    fwrite("DIST", 1, 4, binmapfile);
+    fwrite(&size, sizeof(unsigned long), 1, binmapfile);
+    copyFile(distfile, binmapfile);
+    fclose(succfile);
+    fclose(distfile);
+    printf("Assigned %ld edges\n", nedges);
+    printf("Elapsed time: %f seconds\n", (float)(clock() - start_time) / CLOCKS_PER_SEC);
+
+    start_time = clock();
+    const profilerecord *e = extsortNext(&profsort, NULL);
+    e = streamProfile(binmapfile, "car", 0, &profsort, e, nnodes, tmpdir);
+    e = streamProfile(binmapfile, "bike", 1, &profsort, e, nnodes, tmpdir);
+    streamProfile(binmapfile, "foot", 2, &profsort, e, nnodes, tmpdir);
+    extsortFree(&profsort);
+    extsortFinish(&namesort);
+    streamNames(binmapfile, &namesort, tmpdir);
+    extsortFree(&namesort);
+    printf("Elapsed time: %f seconds\n", (float)(clock() - start_time) / CLOCKS_PER_SEC);
+
+    fclose(binmapfile);
+    printPeakMemory();
+    return 0;
+}
+
+void queuePair(pairbatch *batch, const resolvedrecord *origin, const resolvedrecord *dest, const wayrecord *w, extsort *basesort, extsort *profsort, unsigned long *nbase)
+{
+    unsigned long i = batch->n++;
+    batch->x[2 * i] = origin->x;
+    batch->y[2 * i] = origin->y;
+    batch->z[2 * i] = origin->z;
+    batch->x[2 * i + 1] = dest->x;
+    batch->y[2 * i + 1] = dest->y;
+    batch->z[2 * i + 1] = dest->z;
+    batch->origin[i] = origin->index;
+    batch->dest[i] = dest->index;
+    batch->class[i] = w->class;
+    batch->oneway[i] = w->oneway;
+    batch->maxspeed[i] = w->maxspeed;
+    if (batch->n == PAIRBATCH)
+        flushPairs(batch, basesort, profsort, nbase);
+}
+
+// Computes the length of the queued pairs and sends their edges to the sorts.
+// The length of an edge does not depend on its direction.
+void flushPairs(pairbatch *batch, extsort *basesort, extsort *profsort, unsigned long *nbase)
+{
+    geo_distance(batch->x, batch->y, batch->z, batch->from, batch->to, batch->n, batch->length);
+    for (unsigned long i = 0; i < batch->n; i++)
+    {
+        unsigned long origin = batch->origin[i], dest = batch->dest[i];
+        int oneway = batch->oneway[i];
+        double len = batch->length[i];
+        if (batch->class[i] >= 0)
+        {
+            const roadclass *class = &roadclasses[batch->class[i]];
+            int profileoneway[NPROFILES] = {oneway, oneway == 2 ? 0 : oneway, 0};
+            double speed[NPROFILES] = {batch->maxspeed[i] / 3.6, 0, 0};
+            int allowed[NPROFILES] = {(class->access & ACCESS_CAR) && batch->maxspeed[i] > 0 && oneway != 2,
+                                      class->access & ACCESS_BIKE, class->access & ACCESS_FOOT};
+            for (unsigned long p = 0; p < NPROFILES; p++)
+            {
+                if (!allowed[p])
+                    continue;
+                profilerecord forward = {p, origin, dest, speed[p], len}, backward = {p, dest, origin, speed[p], len};
+                if (profileoneway[p] != -1)
+                    extsortAdd(profsort, &forward, sizeof(forward));
+                if (profileoneway[p] != 1)
+                    extsortAdd(profsort, &backward, sizeof(backward));
+            }
+        }
+        if (oneway == 2)
+            continue;
+        baserecord forward = {origin, 0, dest, len}, backward = {dest, 0, origin, len};
+        if (oneway != -1)
+        {
+            forward.seq = (*nbase)++;
+            extsortAdd(basesort, &forward, sizeof(forward));
+        }
+        if (oneway != 1)
+        {
+            backward.seq = (*nbase)++;
+            extsortAdd(basesort, &backward, sizeof(backward));
+        }
+    }
+    batch->n = 0;
+}
+
+// Writes the PROF section of profile p from the profile edges sorted by
+// profile, origin and destination, as writeProfile does. first[] and the
+// edges go to temporary files until the header, which needs the edge count
+// and the top speed, is known. Returns the first edge of the next profile.
+const profilerecord *streamProfile(FILE *binmapfile, const char *name, unsigned long p, extsort *profsort, const profilerecord *e, unsigned long nnodes, const char *tmpdir)
+{
+    profileheader header;
+    int timed = strcmp(name, "car") == 0;
+    FILE *firstfile = tempFile(tmpdir), *adjfile = tempFile(tmpdir), *weightfile = tempFile(tmpdir);
+    unsigned long n = 0, c = 0, from = 0, to = 0;
+    double vmax = 0, weight = 0;
+
+    fwrite(&n, sizeof(unsigned long), 1, firstfile);
+    for (; e != NULL && e->profile == p; e = extsortNext(profsort, NULL))
+    {
+        double w = e->length;
+        if (timed)
+        {
+            w /= e->speed;
+            if (e->speed > vmax)
+                vmax = e->speed;
+        }
+        if (n > 0 && from == e->from && to == e->to)
+        {
+            if (w < weight)
+                weight = w;
+            continue;
+        }
+        if (n > 0)
+        {
+            fwrite(&to, sizeof(unsigned long), 1, adjfile);
+            fwrite(&weight, sizeof(double), 1, weightfile);
+        }
+        for (; c < e->from; c++)
+            fwrite(&n, sizeof(unsigned long), 1, firstfile); // first[c + 1]
+        from = e->from;
+        to = e->to;
+        weight = w;
+        n++;
+    }
+    if (n > 0)
+    {
+        fwrite(&to, sizeof(unsigned long), 1, adjfile);
+        fwrite(&weight, sizeof(double), 1, weightfile);
+    }
+    for (; c < nnodes; c++)
+        fwrite(&n, sizeof(unsigned long), 1, firstfile);
+
+    memset(&header, 0, sizeof(header));
+    strncpy(header.name, name, sizeof(header.name) - 1);
+    strcpy(header.unit, timed ? "s" : "m");
+    header.hscale = timed ? (vmax > 0 ? 1 / vmax : 0) : 1;
+    header.nedges = n;
+
+    unsigned long size = sizeof(header) + (nnodes + 1 + n) * sizeof(unsigned long) + n * sizeof(double);
+    fwrite("PROF", 1, 4, binmapfile);
+    fwrite(&size, sizeof(unsigned long), 1, binmapfile);
+    fwrite(&header, sizeof(header), 1, binmapfile);
+    copyFile(firstfile, binmapfile);
+    copyFile(adjfile, binmapfile);
+    copyFile(weightfile, binmapfile);
+    printf("Profile %s: %ld edges, weights in %s\n", name, n, header.unit);
+
+    fclose(firstfile);
+    fclose(adjfile);
+    fclose(weightfile);
+    return e;
+}
+
+// Writes the NAME section from the names sorted as compareNames does
+void streamNames(FILE *binmapfile, extsort *namesort, const char *tmpdir)
+{
+    FILE *entryfile = tempFile(tmpdir), *arenafile = tempFile(tmpdir);
+    unsigned long nnamed = 0, arenasize = 0, previous = 0;
+    char *last = NULL;
+    nameentry entry = {0, 0};
+    const namerecord *r;
+
+    while ((r = extsortNext(namesort, NULL)) != NULL)
+    {
+        unsigned long namelen = strlen(r->name) + 1;
+        if (nnamed == 0 || strcmp(r->name, last) != 0)
+        {
+            entry.offset = arenasize;
+            fwrite(r->name, 1, namelen, arenafile);
+            arenasize += namelen;
+            if (namelen > previous)
+            {
+                previous = namelen;
+                last = realloc(last, previous);
+                if (last == NULL)
+                {
+                    fprintf(stderr, "Memory allocation failed.\n");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            strcpy(last, r->name);
+        } // else the same name, stored once
+        entry.node = r->node;
+        fwrite(&entry, sizeof(nameentry), 1, entryfile);
+        nnamed++;
+    }
+
+    unsigned long size = 2 * sizeof(unsigned long) + nnamed * sizeof(nameentry) + arenasize;
+    fwrite("NAME", 1, 4, binmapfile);
+    fwrite(&size, sizeof(unsigned long), 1, binmapfile);
+    fwrite(&nnamed, sizeof(unsigned long), 1, binmapfile);
+    fwrite(&arenasize, sizeof(unsigned long), 1, binmapfile);
+    copyFile(entryfile, binmapfile);
+    copyFile(arenafile, binmapfile);
+    printf("Name index: %ld named nodes, %ld bytes of names\n", nnamed, arenasize);
+
+    free(last);
+    fclose(entryfile);
+    fclose(arenafile);
+}
+
+int compareNodeRecords(const void *a, const void *b)
+{
+    const noderecord *na = a, *nb = b;
+    if (na->id != nb->id)
+        return na->id < nb->id ? -1 : 1;
+    return (na->seq > nb->seq) - (na->seq < nb->seq);
+}
+
+int compareRefRecords(const void *a, const void *b)
+{
+    const refrecord *ra = a, *rb = b;
+    if (ra->id != rb->id)
+        return ra->id < rb->id ? -1 : 1;
+    return (ra->seq > rb->seq) - (ra->seq < rb->seq);
+}
+
+int compareResolvedRecords(const void *a, const void *b)
+{
+    const resolvedrecord *ra = a, *rb = b;
+    return (ra->seq > rb->seq) - (ra->seq < rb->seq);
+}
+
+int compareBaseRecords(const void *a, const void *b)
+{
+    const baserecord *ea = a, *eb = b;
+    if (ea->from != eb->from)
+        return ea->from < eb->from ? -1 : 1;
+    return (ea->seq > eb->seq) - (ea->seq < eb->seq);
+}
+
+int compareProfileRecords(const void *a, const void *b)
+{
+    const profilerecord *ea = a, *eb = b;
+    if (ea->profile != eb->profile)
+        return ea->profile < eb->profile ? -1 : 1;
+    if (ea->from != eb->from)
+        return ea->from < eb->from ? -1 : 1;
+    return (ea->to > eb->to) - (ea->to < eb->to);
+}
+
+int compareNameRecords(const void *a, const void *b)
+{
+    const namerecord *na = a, *nb = b;
+    int c = strcasecmp(na->name, nb->name);
+    if (c == 0)
+        c = strcmp(na->name, nb->name);
+    if (c == 0)
+        c = (na->node > nb->node) - (na->node < nb->node);
+    return c;
+}
+
+// Anonymous file in tmpdir, deleted when it is closed
+FILE *tempFile(const char *tmpdir)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/createbin.XXXXXX", tmpdir);
+    int fd = mkstemp(path);
+    FILE *f = fd >= 0 ? fdopen(fd, "w+b") : NULL;
+    if (f == NULL)
+    {
+        fprintf(stderr, "Error when creating a temporary file in %s\n", tmpdir);
+        exit(EXIT_FAILURE);
+    }
+    unlink(path);
+    return f;
+}
+
+void copyFile(FILE *from, FILE *to)
+{
+    char buffer[1 << 16];
+    size_t n;
+    fflush(from);
+    rewind(from);
+    while ((n = fread(buffer, 1, sizeof(buffer), from)) > 0)
+        fwrite(buffer, 1, n, to);
+}
+
+// Buffer to build one record in, valid until the next call
+void *scratch(unsigned long size)
+{
+    static char *buffer = NULL;
+    static unsigned long capacity = 0;
+    if (size > capacity)
+    {
+        capacity = size > 2 * capacity ? size : 2 * capacity;
+        buffer = realloc(buffer, capacity);
+        if (buffer == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return buffer;
+}
+
+void extsortInit(extsort *s, int (*compare)(const void *, const void *), unsigned long budget, const char *tmpdir)
+{
+    memset(s, 0, sizeof(extsort));
+    s->compare = compare;
+    s->tmpdir = tmpdir;
+    s->budget = budget / sizeof(unsigned long) * sizeof(unsigned long);
+    s->buffer = (char *)malloc(s->budget);
+    if (s->buffer == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void extsortAdd(extsort *s, const void *record, unsigned long len)
+{
+    unsigned long need = sizeof(unsigned long) + (len + 7) / 8 * 8;
+    if (s->used + need + (s->nrecords + 1) * sizeof(unsigned long) > s->budget)
+    {
+        extsortSpill(s);
+        if (need + sizeof(unsigned long) > s->budget)
+        {
+            fprintf(stderr, "A record of %lu bytes does not fit in the sort buffer.\n", len);
+            exit(EXIT_FAILURE);
+        }
+    }
+    unsigned long *offsets = (unsigned long *)(s->buffer + s->budget);
+    memcpy(s->buffer + s->used, &len, sizeof(unsigned long));
+    memcpy(s->buffer + s->used + sizeof(unsigned long), record, len);
+    offsets[-(long)++s->nrecords] = s->used;
+    s->used += need;
+    s->count++;
+}
+
+static const char *sort_buffer;
+static int (*sort_compare)(const void *, const void *);
+
+static int compareOffsets(const void *a, const void *b)
+{
+    return sort_compare(sort_buffer + *(const unsigned long *)a + sizeof(unsigned long),
+                        sort_buffer + *(const unsigned long *)b + sizeof(unsigned long));
+}
+
+static unsigned long *sortBuffer(extsort *s)
+{
+    unsigned long *offsets = (unsigned long *)(s->buffer + s->budget) - s->nrecords;
+    sort_buffer = s->buffer;
+    sort_compare = s->compare;
+    qsort(offsets, s->nrecords, sizeof(unsigned long), compareOffsets);
+    return offsets;
+}
+
+// Sorts the records in the buffer and appends them as a run to the spill file
+void extsortSpill(extsort *s)
+{
+    if (s->nrecords == 0)
+        return;
+    unsigned long *offsets = sortBuffer(s);
+    if (s->spill == NULL)
+        s->spill = tempFile(s->tmpdir);
+    if (s->nruns == s->maxruns)
+    {
+        s->maxruns = s->maxruns ? 2 * s->maxruns : 64;
+        s->runs = realloc(s->runs, s->maxruns * sizeof(sortrun));
+        if (s->runs == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    sortrun *run = &s->runs[s->nruns++];
+    run->start = ftell(s->spill);
+    for (unsigned long i = 0; i < s->nrecords; i++)
+    {
+        unsigned long len;
+        memcpy(&len, s->buffer + offsets[i], sizeof(unsigned long));
+        fwrite(s->buffer + offsets[i], 1, sizeof(unsigned long) + len, s->spill);
+    }
+    run->end = ftell(s->spill);
+    s->spilled++;
+    s->used = 0;
+    s->nrecords = 0;
+}
+
+// Called once all the records are in. When nothing was spilled the records
+// are read back from the buffer, otherwise the buffer is released and its
+// memory goes to the merge of the runs.
+void extsortFinish(extsort *s)
+{
+    if (s->nruns == 0)
+    {
+        sortBuffer(s);
+        s->next = 0;
+        return;
+    }
+    extsortSpill(s);
+    free(s->buffer);
+    s->buffer = NULL;
+    fflush(s->spill);
+
+    unsigned long fanin = s->budget / RUN_MINREAD;
+    if (fanin > RUN_MAXFANIN)
+        fanin = RUN_MAXFANIN;
+    if (fanin < 2)
+        fanin = 2;
+    while (s->nruns > fanin)
+    {
+        // One merge pass: every fanin runs become one in a new spill file
+        FILE *spill = tempFile(s->tmpdir);
+        unsigned long nruns = 0;
+        for (unsigned long first = 0; first < s->nruns; first += fanin)
+        {
+            unsigned long count = s->nruns - first < fanin ? s->nruns - first : fanin;
+            unsigned long start = ftell(spill), len;
+            const void *record;
+            mergeOpen(s, first, count, s->budget);
+            while ((record = mergeNext(s, &len)) != NULL)
+            {
+                fwrite(&len, sizeof(unsigned long), 1, spill);
+                fwrite(record, 1, len, spill);
+            }
+            mergeClose(s, count);
+            s->runs[nruns].start = start;
+            s->runs[nruns++].end = ftell(spill);
+        }
+        fclose(s->spill);
+        fflush(spill);
+        s->spill = spill;
+        s->nruns = nruns;
+    }
+    mergeOpen(s, 0, s->nruns, s->budget);
+}
+
+// Next record in order, valid until the next call. NULL after the last one.
+const void *extsortNext(extsort *s, unsigned long *len)
+{
+    if (s->nruns > 0)
+        return mergeNext(s, len);
+    if (s->next == s->nrecords)
+        return NULL;
+    unsigned long offset = ((unsigned long *)(s->buffer + s->budget) - s->nrecords)[s->next++];
+    if (len != NULL)
+        memcpy(len, s->buffer + offset, sizeof(unsigned long));
+    return s->buffer + offset + sizeof(unsigned long);
+}
+
+void extsortFree(extsort *s)
+{
+    if (s->readers != NULL)
+        mergeClose(s, s->nruns);
+    free(s->buffer);
+    free(s->runs);
+    if (s->spill != NULL)
+        fclose(s->spill);
+    memset(s, 0, sizeof(extsort));
+}
+
+static int heapLess(extsort *s, unsigned long a, unsigned long b)
+{
+    return s->compare(s->readers[a].record, s->readers[b].record) < 0;
+}
+
+static void heapDown(extsort *s, unsigned long i)
+{
+    while (1)
+    {
+        unsigned long smallest = i, l = 2 * i + 1, r = 2 * i + 2;
+        if (l < s->nheap && heapLess(s, s->heap[l], s->heap[smallest]))
+            smallest = l;
+        if (r < s->nheap && heapLess(s, s->heap[r], s->heap[smallest]))
+            smallest = r;
+        if (smallest == i)
+            return;
+        unsigned long t = s->heap[i];
+        s->heap[i] = s->heap[smallest];
+        s->heap[smallest] = t;
+        i = smallest;
+    }
+}
+
+// Opens count runs from first for a merge, sharing budget bytes of read buffers
+void mergeOpen(extsort *s, unsigned long first, unsigned long count, unsigned long budget)
+{
+    unsigned long bufsize = budget / count;
+    if (bufsize < 4096)
+        bufsize = 4096;
+    s->readers = (runreader *)calloc(count, sizeof(runreader));
+    s->heap = (unsigned long *)malloc(count * sizeof(unsigned long));
+    if (s->readers == NULL || s->heap == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    s->nheap = 0;
+    s->last = (unsigned long)-1; // No record handed out yet
+    for (unsigned long i = 0; i < count; i++)
+    {
+        runreader *r = &s->readers[i];
+        r->fd = fileno(s->spill);
+        r->pos = s->runs[first + i].start;
+        r->end = s->runs[first + i].end;
+        r->bufsize = bufsize;
+        r->buf = (char *)malloc(bufsize);
+        if (r->buf == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (readerNext(r))
+            s->heap[s->nheap++] = i;
+    }
+    for (unsigned long i = s->nheap; i-- > 0;)
+        heapDown(s, i);
+}
+
+const void *mergeNext(extsort *s, unsigned long *len)
+{
+    // The reader of the record handed out last moves on only now
+    if (s->last != (unsigned long)-1)
+    {
+        if (!readerNext(&s->readers[s->last]))
+            s->heap[0] = s->heap[--s->nheap];
+        heapDown(s, 0);
+    }
+    if (s->nheap == 0)
+        return NULL;
+    s->last = s->heap[0];
+    if (len != NULL)
+        *len = s->readers[s->last].len;
+    return s->readers[s->last].record;
+}
+
+void mergeClose(extsort *s, unsigned long count)
+{
+    for (unsigned long i = 0; i < count; i++)
+    {
+        free(s->readers[i].buf);
+        free(s->readers[i].record);
+    }
+    free(s->readers);
+    free(s->heap);
+    s->readers = NULL;
+    s->heap = NULL;
+    s->nheap = 0;
+}
+
+static int readerBytes(runreader *r, void *data, unsigned long n)
+{
+    char *out = data;
+    while (n > 0)
+    {
+        if (r->at == r->filled)
+        {
+            unsigned long chunk = r->end - r->pos < r->bufsize ? r->end - r->pos : r->bufsize;
+            if (chunk == 0 || pread(r->fd, r->buf, chunk, r->pos) != (ssize_t)chunk)
+                return 0;
+            r->pos += chunk;
+            r->at = 0;
+            r->filled = chunk;
+        }
+        unsigned long take = r->filled - r->at < n ? r->filled - r->at : n;
+        memcpy(out, r->buf + r->at, take);
+        r->at += take;
+        out += take;
+        n -= take;
+    }
+    return 1;
+}
+
+// Reads the next record of a run. Returns 0 at the end of the run.
+int readerNext(runreader *r)
+{
+    if (!readerBytes(r, &r->len, sizeof(unsigned long)))
+        return 0;
+    if (r->len > r->capacity)
+    {
+        r->capacity = r->len;
+        r->record = realloc(r->record, r->capacity);
+        if (r->record == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return readerBytes(r, r->record, r->len);
+}
@@ -0,0 +1,510 @@
+// createcrp.c
+// - partitions the graph of a .bin file into nested cells by recursive
+//   bisection on the node coordinates and writes map.bin.crp (see crp.h)
+// - computes the cliques of every cell from the edge weights (customization)
+//   and writes map.bin.crp.metric
+// With --customize only the second step runs, on the partition already written,
+// so new weights in the .bin do not need a new partition. --profile partitions
+// the edges of one routing profile of the .bin instead of the whole network;
+// the files are then map.bin.<profile>.crp and map.bin.<profile>.crp.metric.
+// The whole .bin is loaded in memory: only the queries read a part of the map.
+#define _GNU_SOURCE // CPU affinity in numaplace.h, included by binmap.h
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "geokernels.h"
+#include "crp.h"
+#include "binmap.h"
+
+// One customization thread. The copy of the partition has its own file
+// handle and shares every array with the others; each thread computes the
+// cliques of cells id, id + nthreads, ... of the current level.
+typedef struct
+{
+    crpgraph g;
+    double *weight; // Edge weights by position
+    int level, id, nthreads;
+} customizer;
+
+void bisect(graph *map, unsigned long *order, unsigned long lo, unsigned long hi, int depth, int maxdepth, unsigned long cell, unsigned long *leaf, unsigned char *side);
+int writePartition(graph *map, const char *crpname, int nlevels, unsigned long cellsize);
+int customize(graph *map, const char *crpname, int nthreads);
+void *customizeCells(void *arg);
+int compareKey(const void *a, const void *b);
+
+double *bisectkey; // Projection of every node, read by compareKey
+
+int main(int argc, char *argv[])
+{
+    clock_t start_time;
+    graph map;
+    int nlevels = 4, customizeonly = 0, nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned long cellsize = 128;
+    const char *profilename = "dist";
+
+    if (argc < 2)
+    {
+        printf("Usage: %s map.bin [--profile name] [--levels n] [--cellsize nodes] [--threads n]\n", argv[0]);
+        printf("       %s map.bin [--profile name] --customize [--threads n]\n", argv[0]);
+        return 1;
+    }
+    for (int a = 2; a < argc; a++)
+    {
+        if (strcmp(argv[a], "--levels") == 0 && a + 1 < argc)
+            nlevels = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--cellsize") == 0 && a + 1 < argc)
+            cellsize = strtoul(argv[++a], NULL, 10);
+        else if (strcmp(argv[a], "--threads") == 0 && a + 1 < argc)
+            nthreads = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--profile") == 0 && a + 1 < argc)
+            profilename = argv[++a];
+        else if (strcmp(argv[a], "--customize") == 0)
+            customizeonly = 1;
+        else
+        {
+            printf("Unknown option %s\n", argv[a]);
+            return 1;
+        }
+    }
+    if (nlevels < 1 || nlevels > CRP_MAXLEVELS || cellsize < 2)
+    {
+        printf("The number of levels must be between 1 and %d and the cell size at least 2\n", CRP_MAXLEVELS);
+        return 1;
+    }
+
+    start_time = clock();
+    geo_init();
+    map.huge = PLACE_MALLOC;
+    if (loadGraph(argv[1], &map) != 0)
+        return 2;
+    int p = findProfile(&map, profilename);
+    if (p < 0)
+    {
+        printf("Profile %s not found in the map\n", profilename);
+        return 1;
+    }
+    useProfile(&map, p);
+    printf("Loaded %lu nodes and %lu edges of the %s profile (weights in %s)\n", map.nnodes, map.nedges, profilename, map.profiles[p].header.unit);
+    printf("Elapsed time: %f seconds\n", (float)(clock() - start_time) / CLOCKS_PER_SEC);
+
+    char crpname[256];
+    if (p == 0)
+        snprintf(crpname, sizeof(crpname), "%s.crp", argv[1]);
+    else
+        snprintf(crpname, sizeof(crpname), "%s.%s.crp", argv[1], profilename);
+
+    if (!customizeonly)
+    {
+        start_time = clock();
+        if (writePartition(&map, crpname, nlevels, cellsize) != 0)
+            return 2;
+        printf("Partition written to %s\n", crpname);
+        printf("Elapsed time: %f seconds\n", (float)(clock() - start_time) / CLOCKS_PER_SEC);
+    }
+
+    start_time = clock();
+    if (customize(&map, crpname, nthreads < 1 ? 1 : nthreads) != 0)
+        return 2;
+    printf("Customization written to %s.metric\n", crpname);
+    printf("Elapsed time: %f seconds\n", (float)(clock() - start_time) / CLOCKS_PER_SEC);
+
+    return 0;
+}
+
+// Splits order[lo] ... order[hi - 1] in two halves along the direction (north,
+// east or one of the two diagonals) that cuts the fewest edges, until depth
+// reaches maxdepth. The nodes of leaf cell c end up together, in cell order.
+void bisect(graph *map, unsigned long *order, unsigned long lo, unsigned long hi, int depth, int maxdepth, unsigned long cell, unsigned long *leaf, unsigned char *side)
+{
+    if (depth == maxdepth)
+    {
+        for (unsigned long i = lo; i < hi; i++)
+            leaf[order[i]] = cell;
+        return;
+    }
+
+    unsigned long mid = lo + (hi - lo) / 2, bestcut = (unsigned long)-1;
+    int bestdir = 0;
+    double coslat = cos(map->nodes[order[lo]].lat * M_PI / 180.0);
+    for (int dir = 0; dir < 4; dir++)
+    {
+        for (unsigned long i = lo; i < hi; i++)
+        {
+            node *n = &map->nodes[order[i]];
+            double x = n->lon * coslat, y = n->lat;
+            bisectkey[order[i]] = dir == 0 ? x : dir == 1 ? y : dir == 2 ? x + y : x - y;
+        }
+        qsort(order + lo, hi - lo, sizeof(unsigned long), compareKey);
+
+        for (unsigned long i = lo; i < hi; i++)
+            side[order[i]] = i < mid ? 1 : 2;
+        unsigned long cut = 0;
+        for (unsigned long i = lo; i < hi; i++)
+            for (unsigned long e = map->first[order[i]]; e < map->first[order[i] + 1]; e++)
+                if (side[map->adj[e]] != 0 && side[map->adj[e]] != side[order[i]])
+                    cut++;
+        for (unsigned long i = lo; i < hi; i++)
+            side[order[i]] = 0;
+
+        if (cut < bestcut)
+        {
+            bestcut = cut;
+            bestdir = dir;
+        }
+    }
+
+    if (bestdir != 3)
+    {
+        for (unsigned long i = lo; i < hi; i++)
+        {
+            node *n = &map->nodes[order[i]];
+            double x = n->lon * coslat, y = n->lat;
+            bisectkey[order[i]] = bestdir == 0 ? x : bestdir == 1 ? y : x + y;
+        }
+        qsort(order + lo, hi - lo, sizeof(unsigned long), compareKey);
+    }
+
+    bisect(map, order, lo, mid, depth + 1, maxdepth, 2 * cell, leaf, side);
+    bisect(map, order, mid, hi, depth + 1, maxdepth, 2 * cell + 1, leaf, side);
+}
+
+int compareKey(const void *a, const void *b)
+{
+    double ka = bisectkey[*(const unsigned long *)a], kb = bisectkey[*(const unsigned long *)b];
+    if (ka != kb)
+        return ka < kb ? -1 : 1;
+    return *(const unsigned long *)a < *(const unsigned long *)b ? -1 : 1;
+}
+
+int writePartition(graph *map, const char *crpname, int nlevels, unsigned long cellsize)
+{
+    unsigned long n = map->nnodes;
+    int depth = 0;
+    while ((n >> depth) > cellsize)
+        depth++;
+    if (nlevels > depth)
+        nlevels = depth > 0 ? depth : 1;
+    int step = depth > 0 ? depth / nlevels : 0;
+
+    crpgraph g;
+    memset(&g, 0, sizeof(g));
+    g.nnodes = n;
+    g.nedges = map->nedges;
+    g.ncells = 1UL << depth;
+    g.nlevels = nlevels;
+    for (int l = 1; l <= nlevels; l++)
+    {
+        g.shift[l] = (l - 1) * step;
+        g.ncellsat[l] = ((g.ncells - 1) >> g.shift[l]) + 1;
+    }
+
+    unsigned long *order = crpAlloc(n * sizeof(unsigned long)), *leaf = crpAlloc(n * sizeof(unsigned long));
+    unsigned long *rank = crpAlloc(n * sizeof(unsigned long));
+    unsigned char *side = calloc(n + 1, 1), *maxb = calloc(n + 1, 1);
+    bisectkey = crpAlloc(n * sizeof(double));
+    if (side == NULL || maxb == NULL)
+    {
+        printf("Error when allocating the memory for the partition\n");
+        return 2;
+    }
+    for (unsigned long i = 0; i < n; i++)
+        order[i] = i;
+    bisect(map, order, 0, n, 0, depth, 0, leaf, side);
+    for (unsigned long p = 0; p < n; p++)
+        rank[order[p]] = p;
+
+    g.cellstart = crpAlloc((g.ncells + 1) * sizeof(unsigned long));
+    g.celledge = crpAlloc((g.ncells + 1) * sizeof(unsigned long));
+    g.celloffset = crpAlloc(g.ncells * sizeof(unsigned long));
+    for (unsigned long c = 0, p = 0, e = 0; c <= g.ncells; c++)
+    {
+        g.cellstart[c] = p;
+        g.celledge[c] = e;
+        while (p < n && leaf[order[p]] == c)
+        {
+            e += map->first[order[p] + 1] - map->first[order[p]];
+            p++;
+        }
+    }
+
+    // Highest level at which every node is a boundary vertex
+    for (unsigned long u = 0; u < n; u++)
+        for (unsigned long e = map->first[u]; e < map->first[u + 1]; e++)
+        {
+            int cl = crpCutLevel(&g, leaf[u], leaf[map->adj[e]]);
+            if (cl > maxb[rank[u]])
+                maxb[rank[u]] = cl;
+            if (cl > maxb[rank[map->adj[e]]])
+                maxb[rank[map->adj[e]]] = cl;
+        }
+
+    FILE *crpfile = fopen(crpname, "wb");
+    if (crpfile == NULL)
+    {
+        printf("Error when opening the file %s\n", crpname);
+        return 1;
+    }
+    unsigned long value = nlevels, offsets[2] = {0, 0};
+    fwrite("CRP1", 1, 4, crpfile);
+    fwrite(&g.nnodes, sizeof(unsigned long), 1, crpfile);
+    fwrite(&g.nedges, sizeof(unsigned long), 1, crpfile);
+    fwrite(&g.ncells, sizeof(unsigned long), 1, crpfile);
+    fwrite(&value, sizeof(unsigned long), 1, crpfile);
+    fwrite(&g.shift[1], sizeof(unsigned long), nlevels, crpfile);
+    long offsetspos = ftell(crpfile);
+    fwrite(offsets, sizeof(unsigned long), 2, crpfile);
+    fwrite(g.cellstart, sizeof(unsigned long), g.ncells + 1, crpfile);
+    fwrite(g.celledge, sizeof(unsigned long), g.ncells + 1, crpfile);
+    long celloffsetpos = ftell(crpfile);
+    fwrite(g.celloffset, sizeof(unsigned long), g.ncells, crpfile);
+
+    // Boundary vertices of every cell, level by level
+    unsigned long *bvert = crpAlloc(n * sizeof(unsigned long)), *bstart = crpAlloc((g.ncells + 1) * sizeof(unsigned long));
+    for (int l = 1; l <= nlevels; l++)
+    {
+        unsigned long nb = 0, c = 0;
+        for (unsigned long p = 0; p < n; p++)
+        {
+            unsigned long cell = leaf[order[p]] >> g.shift[l];
+            while (c <= cell)
+                bstart[c++] = nb;
+            if (maxb[p] >= l)
+                bvert[nb++] = p;
+        }
+        while (c <= g.ncellsat[l])
+            bstart[c++] = nb;
+        fwrite(&nb, sizeof(unsigned long), 1, crpfile);
+        fwrite(bstart, sizeof(unsigned long), g.ncellsat[l] + 1, crpfile);
+        fwrite(bvert, sizeof(unsigned long), nb, crpfile);
+    }
+
+    // Overlay vertices and their cut edges
+    unsigned long noverlay = 0, ncut = 0;
+    for (unsigned long p = 0; p < n; p++)
+        if (maxb[p] >= 1)
+        {
+            bvert[noverlay++] = p;
+            for (unsigned long e = map->first[order[p]]; e < map->first[order[p] + 1]; e++)
+                if (leaf[map->adj[e]] != leaf[order[p]])
+                    ncut++;
+        }
+    unsigned long *ocut = crpAlloc((noverlay + 1) * sizeof(unsigned long)), *cuttarget = crpAlloc(ncut * sizeof(unsigned long));
+    unsigned char *cutlevel = crpAlloc(ncut);
+    ncut = 0;
+    for (unsigned long k = 0; k < noverlay; k++)
+    {
+        unsigned long u = order[bvert[k]];
+        ocut[k] = ncut;
+        for (unsigned long e = map->first[u]; e < map->first[u + 1]; e++)
+            if (leaf[map->adj[e]] != leaf[u])
+            {
+                cuttarget[ncut] = rank[map->adj[e]];
+                cutlevel[ncut++] = crpCutLevel(&g, leaf[u], leaf[map->adj[e]]);
+            }
+    }
+    ocut[noverlay] = ncut;
+    fwrite(&noverlay, sizeof(unsigned long), 1, crpfile);
+    fwrite(&ncut, sizeof(unsigned long), 1, crpfile);
+    fwrite(bvert, sizeof(unsigned long), noverlay, crpfile);
+    fwrite(ocut, sizeof(unsigned long), noverlay + 1, crpfile);
+    fwrite(cuttarget, sizeof(unsigned long), ncut, crpfile);
+    fwrite(cutlevel, 1, ncut, crpfile);
+
+    // One section per leaf cell
+    for (unsigned long c = 0; c < g.ncells; c++)
+    {
+        g.celloffset[c] = ftell(crpfile);
+        for (unsigned long p = g.cellstart[c]; p < g.cellstart[c + 1]; p++)
+            fwrite(&map->nodes[order[p]].id, sizeof(unsigned long), 1, crpfile);
+        for (unsigned long p = g.cellstart[c]; p < g.cellstart[c + 1]; p++)
+            fwrite(&map->nodes[order[p]].lat, sizeof(double), 1, crpfile);
+        for (unsigned long p = g.cellstart[c]; p < g.cellstart[c + 1]; p++)
+            fwrite(&map->nodes[order[p]].lon, sizeof(double), 1, crpfile);
+        for (unsigned long p = g.cellstart[c]; p < g.cellstart[c + 1]; p++)
+        {
+            unsigned short nsucc = map->first[order[p] + 1] - map->first[order[p]];
+            fwrite(&nsucc, sizeof(unsigned short), 1, crpfile);
+        }
+        for (unsigned long p = g.cellstart[c]; p < g.cellstart[c + 1]; p++)
+            for (unsigned long e = map->first[order[p]]; e < map->first[order[p] + 1]; e++)
+                fwrite(&rank[map->adj[e]], sizeof(unsigned long), 1, crpfile);
+    }
+
+    // Id index (the .bin nodes are sorted by id) and the .bin index of every position
+    offsets[0] = ftell(crpfile);
+    for (unsigned long u = 0; u < n; u++)
+    {
+        fwrite(&map->nodes[u].id, sizeof(unsigned long), 1, crpfile);
+        fwrite(&rank[u], sizeof(unsigned long), 1, crpfile);
+    }
+    offsets[1] = ftell(crpfile);
+    fwrite(order, sizeof(unsigned long), n, crpfile);
+
+    fseek(crpfile, offsetspos, SEEK_SET);
+    fwrite(offsets, sizeof(unsigned long), 2, crpfile);
+    fseek(crpfile, celloffsetpos, SEEK_SET);
+    fwrite(g.celloffset, sizeof(unsigned long), g.ncells, crpfile);
+    fclose(crpfile);
+
+    printf("%lu leaf cells of up to %lu nodes, %d levels, %lu boundary vertices, %lu cut edges\n",
+           g.ncells, cellsize, nlevels, noverlay, ncut);
+
+    free(order);
+    free(leaf);
+    free(rank);
+    free(side);
+    free(maxb);
+    free(bisectkey);
+    free(bvert);
+    free(bstart);
+    free(ocut);
+    free(cuttarget);
+    free(cutlevel);
+    free(g.cellstart);
+    free(g.celledge);
+    free(g.celloffset);
+    return 0;
+}
+
+// Computes the cliques of every cell from the weights of the .bin, level by
+// level with nthreads threads, and writes the metric file. Every thread keeps
+// only one leaf cell in memory at a time.
+int customize(graph *map, const char *crpname, int nthreads)
+{
+    FILE *crpfile = fopen(crpname, "rb");
+    crpgraph g;
+    if (crpfile == NULL || crpReadTopology(crpfile, &g) != 0)
+    {
+        printf("Error when reading the partition %s\n", crpname);
+        return 1;
+    }
+    if (g.nnodes != map->nnodes || g.nedges != map->nedges)
+    {
+        printf("The partition %s does not belong to this map\n", crpname);
+        return 1;
+    }
+
+    // Edge weights by position, and of the cut edges
+    unsigned long *order = crpAlloc(g.nnodes * sizeof(unsigned long)), *rank = crpAlloc(g.nnodes * sizeof(unsigned long));
+    fseek(crpfile, g.perm, SEEK_SET);
+    crpReadArray(crpfile, order, sizeof(unsigned long), g.nnodes);
+    for (unsigned long p = 0; p < g.nnodes; p++)
+        rank[order[p]] = p;
+
+    double *weight = crpAlloc(g.nedges * sizeof(double));
+    for (unsigned long p = 0, e = 0; p < g.nnodes; p++)
+        for (unsigned long f = map->first[order[p]]; f < map->first[order[p] + 1]; f++)
+            weight[e++] = map->weight[f];
+    g.cutweight = crpAlloc(g.ncut * sizeof(double));
+    for (unsigned long k = 0, e = 0; k < g.noverlay; k++)
+    {
+        unsigned long u = order[g.opos[k]], leafu = crpLeaf(&g, g.opos[k]);
+        for (unsigned long f = map->first[u]; f < map->first[u + 1]; f++)
+            if (crpLeaf(&g, rank[map->adj[f]]) != leafu)
+                g.cutweight[e++] = map->weight[f];
+    }
+
+    for (int l = 1; l <= g.nlevels; l++)
+        g.clique[l] = crpAlloc(g.cliquestart[l][g.ncellsat[l]] * sizeof(double));
+
+    customizer *workers = crpAlloc(nthreads * sizeof(customizer));
+    pthread_t *ids = crpAlloc(nthreads * sizeof(pthread_t));
+    for (int t = 0; t < nthreads; t++)
+    {
+        workers[t].g = g;
+        workers[t].weight = weight;
+        workers[t].id = t;
+        workers[t].nthreads = nthreads;
+        if (t > 0)
+            workers[t].g.topofile = fopen(crpname, "rb");
+        if (workers[t].g.topofile == NULL)
+        {
+            printf("Error when opening the file %s\n", crpname);
+            return 1;
+        }
+    }
+    // Level by level, since a level needs the cliques of the one below
+    for (int l = 1; l <= g.nlevels; l++)
+    {
+        for (int t = 0; t < nthreads; t++)
+            workers[t].level = l;
+        for (int t = 1; t < nthreads; t++)
+            pthread_create(&ids[t], NULL, customizeCells, &workers[t]);
+        customizeCells(&workers[0]);
+        for (int t = 1; t < nthreads; t++)
+            pthread_join(ids[t], NULL);
+    }
+    for (int t = 1; t < nthreads; t++)
+        fclose(workers[t].g.topofile);
+    fclose(crpfile);
+
+    char metricname[264];
+    snprintf(metricname, sizeof(metricname), "%s.metric", crpname);
+    FILE *metricfile = fopen(metricname, "wb");
+    if (metricfile == NULL)
+    {
+        printf("Error when opening the file %s\n", metricname);
+        return 1;
+    }
+    fwrite("CRPM", 1, 4, metricfile);
+    fwrite(&g.nedges, sizeof(unsigned long), 1, metricfile);
+    fwrite(&g.ncut, sizeof(unsigned long), 1, metricfile);
+    fwrite(weight, sizeof(double), g.nedges, metricfile);
+    fwrite(g.cutweight, sizeof(double), g.ncut, metricfile);
+    unsigned long cliquesize = 0;
+    for (int l = 1; l <= g.nlevels; l++)
+    {
+        fwrite(g.clique[l], sizeof(double), g.cliquestart[l][g.ncellsat[l]], metricfile);
+        cliquesize += g.cliquestart[l][g.ncellsat[l]];
+    }
+    fclose(metricfile);
+    printf("Customized %d levels, %lu clique entries\n", g.nlevels, cliquesize);
+
+    free(order);
+    free(rank);
+    free(weight);
+    free(workers);
+    free(ids);
+    return 0;
+}
+
+void *customizeCells(void *arg)
+{
+    customizer *self = (customizer *)arg;
+    crpgraph *g = &self->g;
+    int l = self->level;
+    crpsearch s;
+    memset(&s, 0, sizeof(s));
+    unsigned long *local = crpAlloc((g->noverlay + 1) * sizeof(unsigned long));
+
+    for (unsigned long c = self->id; c < g->ncellsat[l]; c += self->nthreads)
+    {
+        unsigned long b0 = g->bstart[l][c], nb = g->bstart[l][c + 1] - b0;
+        double *clique = g->clique[l] + g->cliquestart[l][c];
+        if (l == 1)
+            crpLoadCell(g, c)->weight = self->weight + g->celledge[c];
+        for (unsigned long j = 0; j < nb; j++)
+            local[j] = crpLocal(g, l, c, g->bvert[l][b0 + j]);
+        for (unsigned long i = 0; i < nb; i++)
+        {
+            crpCellSearch(g, l, c, g->bvert[l][b0 + i], &s);
+            for (unsigned long j = 0; j < nb; j++)
+                clique[i * nb + j] = s.dist[local[j]];
+        }
+        if (l == 1)
+            crpFreeCell(g, c);
+    }
+
+    free(local);
+    free(s.dist);
+    free(s.parent);
+    free(s.parentkind);
+    free(s.heap);
+    return NULL;
+}
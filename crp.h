@@ -0,0 +1,497 @@
+// crp.h
+// Multi-level partitioned graph (customizable route planning) shared by
+// createcrp.c, which builds it, and binastar.c, which queries it.
+//
+// The nodes are renumbered so that every leaf cell of the partition is a range
+// of positions. Level 1 cells are the leaf cells, and the cell of a node at
+// level l is its leaf cell >> shift[l], so the cells of every level are nested.
+// A node is a boundary vertex of level l when one of its edges leaves its
+// level l cell, and every cell keeps a clique with the shortest distance inside
+// the cell between each pair of its boundary vertices.
+//
+// map.bin.crp holds the metric independent part (partition, boundary vertices,
+// cut edges and one section per leaf cell with its nodes and edges).
+// map.bin.crp.metric holds the edge weights and the cliques, and is the only
+// file that changes when the weights change.
+//
+// Layout of map.bin.crp (unsigned long unless noted):
+//   "CRP1", nnodes, nedges, ncells, nlevels, shift[1..nlevels], idindex, perm
+//   cellstart[ncells + 1], celledge[ncells + 1], celloffset[ncells]
+//   for every level: nbvert, bstart[ncells of the level + 1], bvert[nbvert]
+//   noverlay, ncut, opos[noverlay], ocut[noverlay + 1], cuttarget[ncut], cutlevel[ncut] (chars)
+//   one section per leaf cell at celloffset[c]: id[n], lat[n], lon[n] (doubles),
+//   nsucc[n] (unsigned shorts), successors as positions
+//   at idindex: (id, position) pairs sorted by id; at perm: the node index in
+//   the .bin of every position
+// Layout of map.bin.crp.metric:
+//   "CRPM", nedges, ncut, weight[nedges] (by position), cutweight[ncut],
+//   then for every level the clique of every cell, row by row (doubles)
+#ifndef CRP_H
+#define CRP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define CRP_MAXLEVELS 8
+
+typedef struct
+{
+    unsigned long n, m;         // Nodes and edges of the cell
+    unsigned long *id;          // OSM id of every node
+    double *lat, *lon;          // Node positions
+    unsigned long *first;       // Edges of local node i are adj[first[i]] ... adj[first[i + 1] - 1]
+    unsigned long *adj;         // Heads as positions
+    double *weight;             // Edge weights
+} crpcell;
+
+typedef struct
+{
+    unsigned long nnodes, nedges, ncells;
+    int nlevels;
+    unsigned long shift[CRP_MAXLEVELS + 1];
+    unsigned long idindex, perm; // File offsets
+    unsigned long *cellstart, *celledge, *celloffset;
+    unsigned long ncellsat[CRP_MAXLEVELS + 1];
+    unsigned long *bstart[CRP_MAXLEVELS + 1], *bvert[CRP_MAXLEVELS + 1];
+    unsigned long noverlay, ncut;
+    unsigned long *opos, *ocut, *cuttarget;
+    unsigned char *cutlevel;
+    // Derived when reading: level l cell and overlay index of every bvert[l]
+    // entry, and index of the head of every cut edge in bvert[cutlevel]
+    unsigned long *bcell[CRP_MAXLEVELS + 1], *boverlay[CRP_MAXLEVELS + 1], *cutslot;
+    // Metric
+    double *cutweight;
+    unsigned long *cliquestart[CRP_MAXLEVELS + 1];
+    double *clique[CRP_MAXLEVELS + 1];
+    unsigned long weightoffset; // Where the edge weights start in the metric file
+    // Leaf cells are read on demand
+    FILE *topofile, *metricfile;
+    crpcell **cells;
+    unsigned long cellsloaded, bytesread;
+} crpgraph;
+
+typedef struct
+{
+    double f;
+    unsigned long local;
+} crpheapitem;
+
+// Dijkstra state of a search restricted to one cell
+typedef struct
+{
+    unsigned long n, capacity;
+    double *dist;
+    long *parent;              // Local index of the predecessor
+    unsigned char *parentkind; // 0 original edge, 1 clique edge of a child cell
+    crpheapitem *heap;
+    unsigned long heapsize, heapcapacity;
+} crpsearch;
+
+static inline unsigned long crpLeaf(crpgraph *g, unsigned long pos)
+{
+    unsigned long l = 0, r = g->ncells; // cellstart[l] <= pos < cellstart[r]
+    while (r - l > 1)
+    {
+        unsigned long m = l + (r - l) / 2;
+        if (g->cellstart[m] <= pos)
+            l = m;
+        else
+            r = m;
+    }
+    return l;
+}
+
+// Index of pos in the sorted range a[lo] ... a[hi - 1], or -1
+static inline long crpFind(const unsigned long *a, unsigned long lo, unsigned long hi, unsigned long pos)
+{
+    while (lo < hi)
+    {
+        unsigned long m = lo + (hi - lo) / 2;
+        if (a[m] == pos)
+            return m;
+        if (a[m] < pos)
+            lo = m + 1;
+        else
+            hi = m;
+    }
+    return -1;
+}
+
+// Highest level at which the two leaf cells differ, 0 if they are the same
+static inline int crpCutLevel(crpgraph *g, unsigned long leafa, unsigned long leafb)
+{
+    for (int l = g->nlevels; l >= 1; l--)
+        if ((leafa >> g->shift[l]) != (leafb >> g->shift[l]))
+            return l;
+    return 0;
+}
+
+// First and last + 1 index in bvert[level - 1] of the children of cell at level
+static inline void crpChildren(crpgraph *g, int level, unsigned long cell, unsigned long *lo, unsigned long *hi)
+{
+    unsigned long k = g->shift[level] - g->shift[level - 1];
+    unsigned long c0 = cell << k, c1 = (cell + 1) << k;
+    if (c1 > g->ncellsat[level - 1])
+        c1 = g->ncellsat[level - 1];
+    *lo = g->bstart[level - 1][c0];
+    *hi = g->bstart[level - 1][c1];
+}
+
+static inline void crpReadArray(FILE *f, void *data, size_t size, size_t n)
+{
+    if (fread(data, size, n, f) != n)
+    {
+        fprintf(stderr, "Error when reading the partitioned map.\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static inline void *crpAlloc(size_t size)
+{
+    void *p = malloc(size ? size : 1);
+    if (p == NULL)
+    {
+        fprintf(stderr, "Memory allocation failed.\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+// Reads everything but the leaf cell sections. The file stays open for crpLoadCell.
+static inline int crpReadTopology(FILE *f, crpgraph *g)
+{
+    char magic[4];
+    unsigned long nlevels;
+    memset(g, 0, sizeof(crpgraph));
+    if (fread(magic, 1, 4, f) != 4 || strncmp(magic, "CRP1", 4) != 0)
+        return 1;
+    crpReadArray(f, &g->nnodes, sizeof(unsigned long), 1);
+    crpReadArray(f, &g->nedges, sizeof(unsigned long), 1);
+    crpReadArray(f, &g->ncells, sizeof(unsigned long), 1);
+    crpReadArray(f, &nlevels, sizeof(unsigned long), 1);
+    if (nlevels < 1 || nlevels > CRP_MAXLEVELS)
+        return 1;
+    g->nlevels = nlevels;
+    crpReadArray(f, &g->shift[1], sizeof(unsigned long), nlevels);
+    crpReadArray(f, &g->idindex, sizeof(unsigned long), 1);
+    crpReadArray(f, &g->perm, sizeof(unsigned long), 1);
+
+    g->cellstart = crpAlloc((g->ncells + 1) * sizeof(unsigned long));
+    g->celledge = crpAlloc((g->ncells + 1) * sizeof(unsigned long));
+    g->celloffset = crpAlloc(g->ncells * sizeof(unsigned long));
+    crpReadArray(f, g->cellstart, sizeof(unsigned long), g->ncells + 1);
+    crpReadArray(f, g->celledge, sizeof(unsigned long), g->ncells + 1);
+    crpReadArray(f, g->celloffset, sizeof(unsigned long), g->ncells);
+
+    for (int l = 1; l <= g->nlevels; l++)
+    {
+        unsigned long nbvert;
+        g->ncellsat[l] = ((g->ncells - 1) >> g->shift[l]) + 1;
+        crpReadArray(f, &nbvert, sizeof(unsigned long), 1);
+        g->bstart[l] = crpAlloc((g->ncellsat[l] + 1) * sizeof(unsigned long));
+        g->bvert[l] = crpAlloc(nbvert * sizeof(unsigned long));
+        crpReadArray(f, g->bstart[l], sizeof(unsigned long), g->ncellsat[l] + 1);
+        crpReadArray(f, g->bvert[l], sizeof(unsigned long), nbvert);
+    }
+
+    crpReadArray(f, &g->noverlay, sizeof(unsigned long), 1);
+    crpReadArray(f, &g->ncut, sizeof(unsigned long), 1);
+    g->opos = crpAlloc(g->noverlay * sizeof(unsigned long));
+    g->ocut = crpAlloc((g->noverlay + 1) * sizeof(unsigned long));
+    g->cuttarget = crpAlloc(g->ncut * sizeof(unsigned long));
+    g->cutlevel = crpAlloc(g->ncut);
+    crpReadArray(f, g->opos, sizeof(unsigned long), g->noverlay);
+    crpReadArray(f, g->ocut, sizeof(unsigned long), g->noverlay + 1);
+    crpReadArray(f, g->cuttarget, sizeof(unsigned long), g->ncut);
+    crpReadArray(f, g->cutlevel, 1, g->ncut);
+
+    for (int l = 1; l <= g->nlevels; l++)
+    {
+        unsigned long nbvert = g->bstart[l][g->ncellsat[l]];
+        g->bcell[l] = crpAlloc(nbvert * sizeof(unsigned long));
+        g->boverlay[l] = crpAlloc(nbvert * sizeof(unsigned long));
+        for (unsigned long c = 0; c < g->ncellsat[l]; c++)
+            for (unsigned long i = g->bstart[l][c]; i < g->bstart[l][c + 1]; i++)
+                g->bcell[l][i] = c;
+        for (unsigned long i = 0, k = 0; i < nbvert; i++)
+        {
+            while (g->opos[k] < g->bvert[l][i])
+                k++;
+            g->boverlay[l][i] = k;
+        }
+    }
+    g->cutslot = crpAlloc(g->ncut * sizeof(unsigned long));
+    for (unsigned long e = 0; e < g->ncut; e++)
+    {
+        int l = g->cutlevel[e];
+        unsigned long c = crpLeaf(g, g->cuttarget[e]) >> g->shift[l];
+        g->cutslot[e] = crpFind(g->bvert[l], g->bstart[l][c], g->bstart[l][c + 1], g->cuttarget[e]);
+    }
+
+    for (int l = 1; l <= g->nlevels; l++)
+    {
+        g->cliquestart[l] = crpAlloc((g->ncellsat[l] + 1) * sizeof(unsigned long));
+        g->cliquestart[l][0] = 0;
+        for (unsigned long c = 0; c < g->ncellsat[l]; c++)
+        {
+            unsigned long nb = g->bstart[l][c + 1] - g->bstart[l][c];
+            g->cliquestart[l][c + 1] = g->cliquestart[l][c] + nb * nb;
+        }
+    }
+
+    g->topofile = f;
+    g->cells = calloc(g->ncells, sizeof(crpcell *));
+    if (g->cells == NULL)
+        return 2;
+    return 0;
+}
+
+// Reads the cut edge weights and the cliques. The file stays open so the
+// weights of a leaf cell are read together with the cell.
+static inline int crpReadMetric(FILE *f, crpgraph *g)
+{
+    char magic[4];
+    unsigned long nedges, ncut;
+    if (fread(magic, 1, 4, f) != 4 || strncmp(magic, "CRPM", 4) != 0)
+        return 1;
+    crpReadArray(f, &nedges, sizeof(unsigned long), 1);
+    crpReadArray(f, &ncut, sizeof(unsigned long), 1);
+    if (nedges != g->nedges || ncut != g->ncut)
+        return 1;
+    g->weightoffset = ftell(f);
+    fseek(f, g->nedges * sizeof(double), SEEK_CUR);
+    g->cutweight = crpAlloc(g->ncut * sizeof(double));
+    crpReadArray(f, g->cutweight, sizeof(double), g->ncut);
+    for (int l = 1; l <= g->nlevels; l++)
+    {
+        g->clique[l] = crpAlloc(g->cliquestart[l][g->ncellsat[l]] * sizeof(double));
+        crpReadArray(f, g->clique[l], sizeof(double), g->cliquestart[l][g->ncellsat[l]]);
+    }
+    g->metricfile = f;
+    return 0;
+}
+
+// Section of leaf cell c, read the first time it is needed. Its weights come
+// from the metric file when there is one; otherwise the caller sets them.
+static inline crpcell *crpLoadCell(crpgraph *g, unsigned long c)
+{
+    if (g->cells[c] != NULL)
+        return g->cells[c];
+
+    crpcell *cell = crpAlloc(sizeof(crpcell));
+    unsigned short *nsucc;
+    cell->n = g->cellstart[c + 1] - g->cellstart[c];
+    cell->m = g->celledge[c + 1] - g->celledge[c];
+    cell->id = crpAlloc(cell->n * sizeof(unsigned long));
+    cell->lat = crpAlloc(cell->n * sizeof(double));
+    cell->lon = crpAlloc(cell->n * sizeof(double));
+    cell->first = crpAlloc((cell->n + 1) * sizeof(unsigned long));
+    cell->adj = crpAlloc(cell->m * sizeof(unsigned long));
+    nsucc = crpAlloc(cell->n * sizeof(unsigned short));
+
+    fseek(g->topofile, g->celloffset[c], SEEK_SET);
+    crpReadArray(g->topofile, cell->id, sizeof(unsigned long), cell->n);
+    crpReadArray(g->topofile, cell->lat, sizeof(double), cell->n);
+    crpReadArray(g->topofile, cell->lon, sizeof(double), cell->n);
+    crpReadArray(g->topofile, nsucc, sizeof(unsigned short), cell->n);
+    crpReadArray(g->topofile, cell->adj, sizeof(unsigned long), cell->m);
+    cell->first[0] = 0;
+    for (unsigned long i = 0; i < cell->n; i++)
+        cell->first[i + 1] = cell->first[i] + nsucc[i];
+    free(nsucc);
+    g->bytesread += cell->n * (3 * sizeof(double) + sizeof(unsigned short)) + cell->m * sizeof(unsigned long);
+
+    cell->weight = NULL;
+    if (g->metricfile != NULL)
+    {
+        cell->weight = crpAlloc(cell->m * sizeof(double));
+        fseek(g->metricfile, g->weightoffset + g->celledge[c] * sizeof(double), SEEK_SET);
+        crpReadArray(g->metricfile, cell->weight, sizeof(double), cell->m);
+        g->bytesread += cell->m * sizeof(double);
+    }
+
+    g->cells[c] = cell;
+    g->cellsloaded++;
+    return cell;
+}
+
+static inline void crpFreeCell(crpgraph *g, unsigned long c)
+{
+    crpcell *cell = g->cells[c];
+    if (cell == NULL)
+        return;
+    free(cell->id);
+    free(cell->lat);
+    free(cell->lon);
+    free(cell->first);
+    free(cell->adj);
+    if (g->metricfile != NULL)
+        free(cell->weight);
+    free(cell);
+    g->cells[c] = NULL;
+}
+
+// Position of the node with the given OSM id, by binary search in the id
+// index on disk. Returns nnodes + 1 if there is none.
+static inline unsigned long crpFindId(crpgraph *g, unsigned long id)
+{
+    unsigned long l = 0, r = g->nnodes, pair[2];
+    while (l < r)
+    {
+        unsigned long m = l + (r - l) / 2;
+        fseek(g->topofile, g->idindex + m * sizeof(pair), SEEK_SET);
+        crpReadArray(g->topofile, pair, sizeof(unsigned long), 2);
+        if (pair[0] == id)
+            return pair[1];
+        if (pair[0] < id)
+            l = m + 1;
+        else
+            r = m;
+    }
+    return g->nnodes + 1;
+}
+
+// Overlay index of a boundary vertex, or -1
+static inline long crpOverlay(crpgraph *g, unsigned long pos)
+{
+    return crpFind(g->opos, 0, g->noverlay, pos);
+}
+
+// Local index of pos in the search space of cell at level, see crpCellSearch
+static inline long crpLocal(crpgraph *g, int level, unsigned long cell, unsigned long pos)
+{
+    if (level == 1)
+        return pos - g->cellstart[cell];
+    unsigned long lo, hi;
+    crpChildren(g, level, cell, &lo, &hi);
+    long i = crpFind(g->bvert[level - 1], lo, hi, pos);
+    return i < 0 ? -1 : i - (long)lo;
+}
+
+static inline unsigned long crpPosition(crpgraph *g, int level, unsigned long cell, unsigned long local)
+{
+    if (level == 1)
+        return g->cellstart[cell] + local;
+    unsigned long lo, hi;
+    crpChildren(g, level, cell, &lo, &hi);
+    return g->bvert[level - 1][lo + local];
+}
+
+static inline void crpRelax(crpsearch *s, unsigned long from, unsigned long to, double d, unsigned char kind)
+{
+    if (d >= s->dist[to])
+        return;
+    s->dist[to] = d;
+    s->parent[to] = from;
+    s->parentkind[to] = kind;
+    if (s->heapsize == s->heapcapacity)
+    {
+        s->heapcapacity = s->heapcapacity ? 2 * s->heapcapacity : 256;
+        s->heap = realloc(s->heap, s->heapcapacity * sizeof(crpheapitem));
+        if (s->heap == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    unsigned long i = s->heapsize++;
+    while (i > 0 && s->heap[(i - 1) / 2].f > d)
+    {
+        s->heap[i] = s->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    s->heap[i].f = d;
+    s->heap[i].local = to;
+}
+
+static inline crpheapitem crpPop(crpsearch *s)
+{
+    crpheapitem top = s->heap[0], last = s->heap[--s->heapsize];
+    unsigned long i = 0, child;
+    while ((child = 2 * i + 1) < s->heapsize)
+    {
+        if (child + 1 < s->heapsize && s->heap[child + 1].f < s->heap[child].f)
+            child++;
+        if (s->heap[child].f >= last.f)
+            break;
+        s->heap[i] = s->heap[child];
+        i = child;
+    }
+    s->heap[i] = last;
+    return top;
+}
+
+// Dijkstra from source (a position) that never leaves cell at level. On level
+// 1 it runs on the original edges of the leaf cell and the local index of a
+// node is its position minus the first position of the cell. On higher levels
+// it runs on the cliques of the children cells and the cut edges between them,
+// and the local index is the index in bvert[level - 1] minus the first index of
+// the children. Returns 0 if source is not in the search space.
+static inline int crpCellSearch(crpgraph *g, int level, unsigned long cell, unsigned long source, crpsearch *s)
+{
+    unsigned long n;
+    if (level == 1)
+        n = g->cellstart[cell + 1] - g->cellstart[cell];
+    else
+    {
+        unsigned long lo, hi;
+        crpChildren(g, level, cell, &lo, &hi);
+        n = hi - lo;
+    }
+    if (n > s->capacity)
+    {
+        s->capacity = n;
+        s->dist = realloc(s->dist, n * sizeof(double));
+        s->parent = realloc(s->parent, n * sizeof(long));
+        s->parentkind = realloc(s->parentkind, n);
+        if (s->dist == NULL || s->parent == NULL || s->parentkind == NULL)
+        {
+            fprintf(stderr, "Memory allocation failed.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    s->n = n;
+    for (unsigned long i = 0; i < n; i++)
+        s->dist[i] = INFINITY;
+    s->heapsize = 0;
+
+    long src = crpLocal(g, level, cell, source);
+    if (src < 0)
+        return 0;
+    crpRelax(s, -1, src, 0, 0);
+
+    crpcell *leaf = level == 1 ? crpLoadCell(g, cell) : NULL;
+    while (s->heapsize != 0)
+    {
+        crpheapitem current = crpPop(s);
+        if (current.f > s->dist[current.local])
+            continue;
+        if (level == 1)
+        {
+            unsigned long v = current.local;
+            for (unsigned long e = leaf->first[v]; e < leaf->first[v + 1]; e++)
+                if (leaf->adj[e] >= g->cellstart[cell] && leaf->adj[e] < g->cellstart[cell + 1])
+                    crpRelax(s, v, leaf->adj[e] - g->cellstart[cell], current.f + leaf->weight[e], 0);
+            continue;
+        }
+        // Clique of the child cell of this vertex
+        unsigned long lo, hi;
+        crpChildren(g, level, cell, &lo, &hi);
+        unsigned long i = lo + current.local, child = g->bcell[level - 1][i];
+        unsigned long b0 = g->bstart[level - 1][child], nb = g->bstart[level - 1][child + 1] - b0;
+        double *row = g->clique[level - 1] + g->cliquestart[level - 1][child] + (i - b0) * nb;
+        for (unsigned long j = 0; j < nb; j++)
+            if (row[j] != INFINITY)
+                crpRelax(s, current.local, b0 + j - lo, current.f + row[j], 1);
+        // Cut edges to the other children
+        unsigned long k = g->boverlay[level - 1][i];
+        for (unsigned long e = g->ocut[k]; e < g->ocut[k + 1]; e++)
+            if (g->cutlevel[e] == level - 1)
+                crpRelax(s, current.local, g->cutslot[e] - lo, current.f + g->cutweight[e], 0);
+    }
+    return 1;
+}
+
+#endif
@@ -0,0 +1,257 @@
+// geokernels.h
+// Batched geodesic kernels shared by createbin.c and binastar.c.
+// - geo_unitvector converts a node position to a point on the unit sphere. The
+//   callers keep these points in three separate arrays (x, y, z) so the kernels
+//   can gather them with vector loads.
+// - geo_distance computes the great-circle distance of many (from, to) pairs.
+// - geo_heuristic computes the great-circle distance of many nodes to one target.
+// Both return meters and agree with haversine() up to rounding. There are AVX2
+// and AVX-512 versions and a scalar fallback; geo_init() picks the best one the
+// CPU supports (the GEO_KERNEL environment variable can force one of them).
+#ifndef GEOKERNELS_H
+#define GEOKERNELS_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define GEO_X86 1
+#include <immintrin.h>
+#else
+#define GEO_X86 0
+#endif
+
+#ifndef M_PI
+#define M_PI (3.14159265358979323846)
+#endif
+
+#define GEO_EARTH_RADIUS 6371000.0 // meters, the same value haversine() uses
+
+// The arc is asin(chord / 2). Below this half chord (~200 km of arc) a short
+// series is exact to double precision, so the kernels only need sqrt, + and *.
+#define GEO_SERIES_MAX (1.0 / 64.0)
+
+typedef void (*geo_distance_fn)(const double *x, const double *y, const double *z,
+                                const unsigned long *from, const unsigned long *to,
+                                unsigned long n, double *out);
+typedef void (*geo_heuristic_fn)(const double *x, const double *y, const double *z,
+                                 const unsigned long *idx, unsigned long n,
+                                 double tx, double ty, double tz, double *out);
+
+typedef struct
+{
+    const char *name;
+    geo_distance_fn distance;
+    geo_heuristic_fn heuristic;
+} geo_kernel;
+
+static inline void geo_unitvector(double lat, double lon, double *x, double *y, double *z)
+{
+    double la = lat * M_PI / 180.0, lo = lon * M_PI / 180.0;
+    *x = cos(la) * cos(lo);
+    *y = cos(la) * sin(lo);
+    *z = sin(la);
+}
+
+// Great-circle distance from half the chord length between two unit vectors
+static inline double geo_arc(double s)
+{
+    if (s > GEO_SERIES_MAX)
+        return 2.0 * GEO_EARTH_RADIUS * asin(s < 1.0 ? s : 1.0);
+    double s2 = s * s;
+    double p = 945.0 / 42240.0;
+    p = p * s2 + 105.0 / 3456.0;
+    p = p * s2 + 15.0 / 336.0;
+    p = p * s2 + 3.0 / 40.0;
+    p = p * s2 + 1.0 / 6.0;
+    p = p * s2 + 1.0;
+    return 2.0 * GEO_EARTH_RADIUS * (s * p);
+}
+
+static inline void geo_distance_scalar(const double *x, const double *y, const double *z,
+                                       const unsigned long *from, const unsigned long *to,
+                                       unsigned long n, double *out)
+{
+    for (unsigned long i = 0; i < n; i++)
+    {
+        double dx = x[to[i]] - x[from[i]], dy = y[to[i]] - y[from[i]], dz = z[to[i]] - z[from[i]];
+        out[i] = geo_arc(0.5 * sqrt(dx * dx + dy * dy + dz * dz));
+    }
+}
+
+static inline void geo_heuristic_scalar(const double *x, const double *y, const double *z,
+                                        const unsigned long *idx, unsigned long n,
+                                        double tx, double ty, double tz, double *out)
+{
+    for (unsigned long i = 0; i < n; i++)
+    {
+        double dx = x[idx[i]] - tx, dy = y[idx[i]] - ty, dz = z[idx[i]] - tz;
+        out[i] = geo_arc(0.5 * sqrt(dx * dx + dy * dy + dz * dz));
+    }
+}
+
+#if GEO_X86
+
+// Series of geo_arc for a whole vector; lanes above GEO_SERIES_MAX are redone
+// with the scalar version by the caller.
+__attribute__((target("avx2"))) static inline __m256d geo_arc_avx2(__m256d s)
+{
+    __m256d s2 = _mm256_mul_pd(s, s);
+    __m256d p = _mm256_set1_pd(945.0 / 42240.0);
+    p = _mm256_add_pd(_mm256_mul_pd(p, s2), _mm256_set1_pd(105.0 / 3456.0));
+    p = _mm256_add_pd(_mm256_mul_pd(p, s2), _mm256_set1_pd(15.0 / 336.0));
+    p = _mm256_add_pd(_mm256_mul_pd(p, s2), _mm256_set1_pd(3.0 / 40.0));
+    p = _mm256_add_pd(_mm256_mul_pd(p, s2), _mm256_set1_pd(1.0 / 6.0));
+    p = _mm256_add_pd(_mm256_mul_pd(p, s2), _mm256_set1_pd(1.0));
+    return _mm256_mul_pd(_mm256_set1_pd(2.0 * GEO_EARTH_RADIUS), _mm256_mul_pd(s, p));
+}
+
+__attribute__((target("avx2"))) static inline void geo_store_avx2(__m256d s, double *out)
+{
+    int far = _mm256_movemask_pd(_mm256_cmp_pd(s, _mm256_set1_pd(GEO_SERIES_MAX), _CMP_GT_OQ));
+    _mm256_storeu_pd(out, geo_arc_avx2(s));
+    if (far)
+    {
+        double lanes[4];
+        _mm256_storeu_pd(lanes, s);
+        for (int k = 0; k < 4; k++)
+            if (far & (1 << k))
+                out[k] = geo_arc(lanes[k]);
+    }
+}
+
+__attribute__((target("avx2"))) static inline void geo_distance_avx2(const double *x, const double *y, const double *z,
+                                                                     const unsigned long *from, const unsigned long *to,
+                                                                     unsigned long n, double *out)
+{
+    unsigned long i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i f = _mm256_loadu_si256((const __m256i *)(from + i));
+        __m256i t = _mm256_loadu_si256((const __m256i *)(to + i));
+        __m256d dx = _mm256_sub_pd(_mm256_i64gather_pd(x, t, 8), _mm256_i64gather_pd(x, f, 8));
+        __m256d dy = _mm256_sub_pd(_mm256_i64gather_pd(y, t, 8), _mm256_i64gather_pd(y, f, 8));
+        __m256d dz = _mm256_sub_pd(_mm256_i64gather_pd(z, t, 8), _mm256_i64gather_pd(z, f, 8));
+        __m256d c2 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)), _mm256_mul_pd(dz, dz));
+        geo_store_avx2(_mm256_mul_pd(_mm256_set1_pd(0.5), _mm256_sqrt_pd(c2)), out + i);
+    }
+    geo_distance_scalar(x, y, z, from + i, to + i, n - i, out + i);
+}
+
+__attribute__((target("avx2"))) static inline void geo_heuristic_avx2(const double *x, const double *y, const double *z,
+                                                                      const unsigned long *idx, unsigned long n,
+                                                                      double tx, double ty, double tz, double *out)
+{
+    unsigned long i = 0;
+    __m256d vx = _mm256_set1_pd(tx), vy = _mm256_set1_pd(ty), vz = _mm256_set1_pd(tz);
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(idx + i));
+        __m256d dx = _mm256_sub_pd(_mm256_i64gather_pd(x, v, 8), vx);
+        __m256d dy = _mm256_sub_pd(_mm256_i64gather_pd(y, v, 8), vy);
+        __m256d dz = _mm256_sub_pd(_mm256_i64gather_pd(z, v, 8), vz);
+        __m256d c2 = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)), _mm256_mul_pd(dz, dz));
+        geo_store_avx2(_mm256_mul_pd(_mm256_set1_pd(0.5), _mm256_sqrt_pd(c2)), out + i);
+    }
+    geo_heuristic_scalar(x, y, z, idx + i, n - i, tx, ty, tz, out + i);
+}
+
+__attribute__((target("avx512f"))) static inline __m512d geo_arc_avx512(__m512d s)
+{
+    __m512d s2 = _mm512_mul_pd(s, s);
+    __m512d p = _mm512_set1_pd(945.0 / 42240.0);
+    p = _mm512_add_pd(_mm512_mul_pd(p, s2), _mm512_set1_pd(105.0 / 3456.0));
+    p = _mm512_add_pd(_mm512_mul_pd(p, s2), _mm512_set1_pd(15.0 / 336.0));
+    p = _mm512_add_pd(_mm512_mul_pd(p, s2), _mm512_set1_pd(3.0 / 40.0));
+    p = _mm512_add_pd(_mm512_mul_pd(p, s2), _mm512_set1_pd(1.0 / 6.0));
+    p = _mm512_add_pd(_mm512_mul_pd(p, s2), _mm512_set1_pd(1.0));
+    return _mm512_mul_pd(_mm512_set1_pd(2.0 * GEO_EARTH_RADIUS), _mm512_mul_pd(s, p));
+}
+
+__attribute__((target("avx512f"))) static inline void geo_store_avx512(__m512d s, double *out)
+{
+    __mmask8 far = _mm512_cmp_pd_mask(s, _mm512_set1_pd(GEO_SERIES_MAX), _CMP_GT_OQ);
+    _mm512_storeu_pd(out, geo_arc_avx512(s));
+    if (far)
+    {
+        double lanes[8];
+        _mm512_storeu_pd(lanes, s);
+        for (int k = 0; k < 8; k++)
+            if (far & (1 << k))
+                out[k] = geo_arc(lanes[k]);
+    }
+}
+
+__attribute__((target("avx512f"))) static inline void geo_distance_avx512(const double *x, const double *y, const double *z,
+                                                                          const unsigned long *from, const unsigned long *to,
+                                                                          unsigned long n, double *out)
+{
+    unsigned long i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m512i f = _mm512_loadu_si512((const void *)(from + i));
+        __m512i t = _mm512_loadu_si512((const void *)(to + i));
+        __m512d dx = _mm512_sub_pd(_mm512_i64gather_pd(t, x, 8), _mm512_i64gather_pd(f, x, 8));
+        __m512d dy = _mm512_sub_pd(_mm512_i64gather_pd(t, y, 8), _mm512_i64gather_pd(f, y, 8));
+        __m512d dz = _mm512_sub_pd(_mm512_i64gather_pd(t, z, 8), _mm512_i64gather_pd(f, z, 8));
+        __m512d c2 = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx, dx), _mm512_mul_pd(dy, dy)), _mm512_mul_pd(dz, dz));
+        geo_store_avx512(_mm512_mul_pd(_mm512_set1_pd(0.5), _mm512_sqrt_pd(c2)), out + i);
+    }
+    geo_distance_scalar(x, y, z, from + i, to + i, n - i, out + i);
+}
+
+__attribute__((target("avx512f"))) static inline void geo_heuristic_avx512(const double *x, const double *y, const double *z,
+                                                                           const unsigned long *idx, unsigned long n,
+                                                                           double tx, double ty, double tz, double *out)
+{
+    unsigned long i = 0;
+    __m512d vx = _mm512_set1_pd(tx), vy = _mm512_set1_pd(ty), vz = _mm512_set1_pd(tz);
+    for (; i + 8 <= n; i += 8)
+    {
+        __m512i v = _mm512_loadu_si512((const void *)(idx + i));
+        __m512d dx = _mm512_sub_pd(_mm512_i64gather_pd(v, x, 8), vx);
+        __m512d dy = _mm512_sub_pd(_mm512_i64gather_pd(v, y, 8), vy);
+        __m512d dz = _mm512_sub_pd(_mm512_i64gather_pd(v, z, 8), vz);
+        __m512d c2 = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx, dx), _mm512_mul_pd(dy, dy)), _mm512_mul_pd(dz, dz));
+        geo_store_avx512(_mm512_mul_pd(_mm512_set1_pd(0.5), _mm512_sqrt_pd(c2)), out + i);
+    }
+    geo_heuristic_scalar(x, y, z, idx + i, n - i, tx, ty, tz, out + i);
+}
+
+#endif
+
+// Fills list with the kernels this CPU can run, best last. Returns how many.
+static inline int geo_available_kernels(geo_kernel *list)
+{
+    int n = 0;
+    list[n++] = (geo_kernel){"scalar", geo_distance_scalar, geo_heuristic_scalar};
+#if GEO_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        list[n++] = (geo_kernel){"avx2", geo_distance_avx2, geo_heuristic_avx2};
+    if (__builtin_cpu_supports("avx512f"))
+        list[n++] = (geo_kernel){"avx512", geo_distance_avx512, geo_heuristic_avx512};
+#endif
+    return n;
+}
+
+static geo_distance_fn geo_distance = geo_distance_scalar;
+static geo_heuristic_fn geo_heuristic = geo_heuristic_scalar;
+
+// Selects the kernels used through geo_distance and geo_heuristic. Returns the name of the chosen one.
+static inline const char *geo_init(void)
+{
+    geo_kernel list[3];
+    int n = geo_available_kernels(list), chosen = n - 1;
+    const char *force = getenv("GEO_KERNEL");
+    if (force != NULL)
+        for (int i = 0; i < n; i++)
+            if (strcmp(list[i].name, force) == 0)
+                chosen = i;
+    geo_distance = list[chosen].distance;
+    geo_heuristic = list[chosen].heuristic;
+    return list[chosen].name;
+}
+
+#endif
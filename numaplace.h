@@ -0,0 +1,185 @@
+// numaplace.h
+// Memory placement for the read-only graph arrays: huge page backing and one
+// copy per NUMA node, with the threads pinned next to their copy. Plain Linux
+// system calls, so there is no libnuma to link. The file that includes it has
+// to define _GNU_SOURCE before any system header.
+
+#ifndef NUMAPLACE_H
+#define NUMAPLACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define PLACE_MALLOC 0  // Normal pages
+#define PLACE_THP 1     // Transparent huge pages (madvise)
+#define PLACE_HUGETLB 2 // Explicit huge pages, reserved with vm.nr_hugepages
+
+#define PLACE_HUGEPAGE (2UL << 20)
+#define PLACE_MAXNODES 64
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+#define PLACE_MPOL_BIND 2
+
+static const char *place_names[] __attribute__((unused)) = {"4k pages", "THP", "hugetlb"};
+
+// Checks that explicit huge pages can really be mapped and falls back to
+// transparent ones when none are reserved. Returns the mode to use.
+static inline int placeInit(int huge)
+{
+    if (huge != PLACE_HUGETLB)
+        return huge;
+    void *probe = mmap(NULL, PLACE_HUGEPAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (probe == MAP_FAILED)
+    {
+        printf("No explicit huge pages reserved (vm.nr_hugepages), using transparent huge pages\n");
+        return PLACE_THP;
+    }
+    munmap(probe, PLACE_HUGEPAGE);
+    return PLACE_HUGETLB;
+}
+
+static inline size_t placeSize(size_t size, int huge)
+{
+    size_t unit = huge == PLACE_MALLOC ? 4096 : PLACE_HUGEPAGE;
+    return (size + unit - 1) / unit * unit;
+}
+
+// size bytes backed as huge asks and, for node >= 0, bound to that NUMA node
+// before they are first touched. Returns NULL if the memory is not available.
+static inline void *placeAlloc(size_t size, int huge, int node)
+{
+    void *ptr;
+    if (size == 0)
+        size = 1;
+    if (node < 0 && huge == PLACE_MALLOC)
+        return malloc(size);
+    if (node < 0 && huge == PLACE_THP)
+    {
+        ptr = aligned_alloc(PLACE_HUGEPAGE, placeSize(size, huge));
+        if (ptr != NULL)
+            madvise(ptr, placeSize(size, huge), MADV_HUGEPAGE);
+        return ptr;
+    }
+
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | (huge == PLACE_HUGETLB ? MAP_HUGETLB : 0);
+    ptr = mmap(NULL, placeSize(size, huge), PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (ptr == MAP_FAILED)
+        return NULL;
+    if (huge == PLACE_THP)
+        madvise(ptr, placeSize(size, huge), MADV_HUGEPAGE);
+    if (node >= 0)
+    {
+        unsigned long mask[PLACE_MAXNODES / 64] = {0};
+        mask[node / 64] = 1UL << (node % 64);
+        if (syscall(SYS_mbind, ptr, placeSize(size, huge), PLACE_MPOL_BIND, mask, PLACE_MAXNODES, 0) != 0)
+            perror("mbind");
+    }
+    return ptr;
+}
+
+static inline void placeFree(void *ptr, size_t size, int huge, int node)
+{
+    if (ptr == NULL)
+        return;
+    if (node < 0 && huge != PLACE_HUGETLB)
+        free(ptr);
+    else
+        munmap(ptr, placeSize(size ? size : 1, huge));
+}
+
+// Number of NUMA nodes with CPUs, 1 on machines without NUMA support
+static inline int numaNodes(void)
+{
+    int n = 0;
+    char path[64];
+    while (n < PLACE_MAXNODES)
+    {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+        if (access(path, R_OK) != 0)
+            break;
+        n++;
+    }
+    return n > 0 ? n : 1;
+}
+
+// CPUs of a NUMA node, read from its cpulist ("0-3,8-11")
+static inline int numaNodeCpus(int node, cpu_set_t *set)
+{
+    char path[64], list[4096];
+    CPU_ZERO(set);
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    FILE *f = fopen(path, "r");
+    if (f == NULL || fgets(list, sizeof(list), f) == NULL)
+    {
+        if (f != NULL)
+            fclose(f);
+        return 0;
+    }
+    fclose(f);
+    int ncpus = 0;
+    for (char *range = strtok(list, ",\n"); range != NULL; range = strtok(NULL, ",\n"))
+    {
+        int lo, hi;
+        int n = sscanf(range, "%d-%d", &lo, &hi);
+        if (n < 1)
+            continue;
+        if (n == 1)
+            hi = lo;
+        for (int c = lo; c <= hi && c < CPU_SETSIZE; c++, ncpus++)
+            CPU_SET(c, set);
+    }
+    return ncpus;
+}
+
+// Pins the calling thread to the CPUs of a NUMA node
+static inline int pinThread(int node)
+{
+    cpu_set_t set;
+    if (numaNodeCpus(node, &set) == 0)
+        return -1;
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// Counter of the data TLB misses of the calling thread, in user space. Returns
+// -1 where perf events are not allowed (see kernel.perf_event_paranoid).
+static inline int perfOpenTlb(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd >= 0)
+    {
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    return fd;
+}
+
+static inline long long perfRead(int fd)
+{
+    long long count;
+    if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count))
+        return -1;
+    return count;
+}
+
+#endif